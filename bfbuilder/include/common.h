@@ -33,18 +33,35 @@
 
 #define COMMON_NO_HYPERVISOR bfscast(status_t, 0x8000000000000001)
 #define COMMON_CREATE_VM_FROM_BZIMAGE_FAILED bfscast(status_t, 0x8000000000000002)
+#define COMMON_PREPARE_VM_FAILED bfscast(status_t, 0x8000000000000003)
 
 /* -------------------------------------------------------------------------- */
 /* Functions                                                                  */
 /* -------------------------------------------------------------------------- */
 
+/**
+ * Prepare VM
+ *
+ * The following function creates a domain, allocates and donates its RAM,
+ * and sets up its boot structures and initial register state, but does not
+ * load a kernel. The resulting VM is placed in a pool, and is used by the
+ * next call to common_create_vm_from_bzimage that asks for the same amount
+ * of RAM.
+ *
+ * @param args the prepare_vm_args arguments needed to prepare the VM
+ * @return SUCCESS on success, negative error code on failure
+ */
+int64_t
+common_prepare_vm(struct prepare_vm_args *args);
+
 /**
  * Create VM from bzImage
  *
  * The following function builds a guest VM based on a provided bzImage.
  * To accomplish this, the following function will allocate RAM, load RAM
  * with the contents of the provided file, and then set up the guest's
- * memory map.
+ * memory map. If a prepared VM with the same amount of RAM exists (see
+ * common_prepare_vm), it is used instead, and only the kernel is loaded.
  *
  * @param args the create_vm_from_bzimage_args arguments needed to create the VM
  * @return SUCCESS on success, negative error code on failure
@@ -55,6 +55,7 @@ struct vm_t {
     uint64_t size;
 
     int used;
+    int prepared;
 };
 
 static struct vm_t g_vms[MAX_VMS] = {0};
@@ -76,6 +77,7 @@ acquire_vm(void)
 
     if (i == MAX_VMS) {
         BFALERT("MAX_VMS reached. Could not acquire VM\n");
+        vm = 0;
         goto done;
     }
 
@@ -257,34 +259,28 @@ setup_pt_uart(
 #define HDR_SIZE sizeof(struct setup_header)
 
 static status_t
-setup_cmdline(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
+setup_ram(struct vm_t *vm, uint64_t size)
 {
     status_t ret = SUCCESS;
 
-    vm->cmdline = bfalloc_page(char);
-    if (vm->cmdline == 0) {
-        BFDEBUG("setup_cmdline: failed to alloc cmdline page\n");
-        return FAILURE;
-    }
+    vm->size = size;
+    vm->addr = bfalloc_buffer(char, vm->size);
 
-    ret = platform_memcpy(
-        vm->cmdline, BAREFLANK_PAGE_SIZE, args->cmdl, args->cmdl_size, args->cmdl_size);
-    if (ret != SUCCESS) {
-        return ret;
+    if (vm->addr == 0) {
+        BFDEBUG("setup_ram: failed to alloc ram\n");
+        return FAILURE;
     }
 
-    ret = donate_page_r(vm, vm->cmdline, COMMAND_LINE_PAGE_GPA);
+    ret = donate_buffer(vm, vm->addr, 0x100000, vm->size);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    vm->params->hdr.cmd_line_ptr = COMMAND_LINE_PAGE_GPA;
     return SUCCESS;
 }
 
 static status_t
-setup_boot_params(
-    struct vm_t *vm, struct create_vm_from_bzimage_args *args, const struct setup_header *hdr)
+setup_boot_params(struct vm_t *vm)
 {
     status_t ret = SUCCESS;
 
@@ -294,32 +290,113 @@ setup_boot_params(
         return FAILURE;
     }
 
-    ret = platform_memcpy(&vm->params->hdr, HDR_SIZE, hdr, HDR_SIZE, HDR_SIZE);
+    ret = donate_page_rw(vm, vm->params, BOOT_PARAMS_PAGE_GPA);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = donate_page_rw(vm, vm->params, BOOT_PARAMS_PAGE_GPA);
+    vm->cmdline = bfalloc_page(char);
+    if (vm->cmdline == 0) {
+        BFDEBUG("setup_boot_params: failed to alloc cmdline page\n");
+        return FAILURE;
+    }
+
+    ret = donate_page_r(vm, vm->cmdline, COMMAND_LINE_PAGE_GPA);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_cmdline(vm, args);
+    ret = setup_e820_map(vm, vm->size);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_e820_map(vm, args->size);
+    return SUCCESS;
+}
+
+static status_t
+setup_bios_ram(struct vm_t *vm)
+{
+    status_t ret;
+
+    vm->bios_ram = bfalloc_buffer(void, BIOS_RAM_SIZE);
+    if (vm->bios_ram == 0) {
+        BFDEBUG("setup_bios_ram: failed to alloc bios ram\n");
+        return FAILURE;
+    }
+
+    ret = donate_buffer(vm, vm->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    vm->params->hdr.type_of_loader = 0xFF;
     return SUCCESS;
 }
 
+/* -------------------------------------------------------------------------- */
+/* Kernel Functions                                                           */
+/* -------------------------------------------------------------------------- */
+
 static status_t
-setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
+check_kernel(struct create_vm_from_bzimage_args *args)
+{
+    const struct setup_header *hdr = (struct setup_header *)(args->bzimage + 0x1f1);
+
+    if (args->bzimage == 0) {
+        BFDEBUG("check_kernel: bzImage is null\n");
+        return FAILURE;
+    }
+
+    if (args->size == 0) {
+        BFDEBUG("check_kernel: bzImage has 0 size\n");
+        return FAILURE;
+    }
+
+    if (args->bzimage_size + args->initrd_size > args->size) {
+        BFDEBUG("check_kernel: requested RAM is too small\n");
+        return FAILURE;
+    }
+
+    if (hdr->header != 0x53726448) {
+        BFDEBUG("check_kernel: bzImage does not contain magic number\n");
+        return FAILURE;
+    }
+
+    if (hdr->version < 0x020d) {
+        BFDEBUG("check_kernel: unsupported bzImage protocol\n");
+        return FAILURE;
+    }
+
+    if (hdr->code32_start != 0x100000) {
+        BFDEBUG("check_kernel: unsupported bzImage start location\n");
+        return FAILURE;
+    }
+
+    if (((hdr->setup_sects + 1) * 512) > args->bzimage_size) {
+        BFDEBUG("check_kernel: corrupt setup_sects\n");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+static status_t
+load_cmdline(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
+{
+    status_t ret = SUCCESS;
+
+    ret = platform_memcpy(
+        vm->cmdline, BAREFLANK_PAGE_SIZE, args->cmdl, args->cmdl_size, args->cmdl_size);
+    if (ret != SUCCESS) {
+        return ret;
+    }
+
+    vm->params->hdr.cmd_line_ptr = COMMAND_LINE_PAGE_GPA;
+    return SUCCESS;
+}
+
+static status_t
+load_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
 {
     /**
      * Notes:
@@ -355,6 +432,11 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
      *
      *   This code will unpack the kernel and put it into the proper place in
      *   memory. From there, it will boot the kernel.
+     *
+     * The guest's RAM has already been donated (see prepare_vm), and donated
+     * pages are still mapped by the builder, so the kernel and initrd are
+     * simply copied into place. The kernel must be checked with check_kernel
+     * before this function is called.
      */
 
     status_t ret = SUCCESS;
@@ -364,51 +446,8 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     uint64_t kernel_size = 0;
     uint64_t kernel_offset = 0;
 
-    if (args->bzimage == 0) {
-        BFDEBUG("setup_kernel: bzImage is null\n");
-        return FAILURE;
-    }
-
-    if (args->size == 0) {
-        BFDEBUG("setup_kernel: bzImage has 0 size\n");
-        return FAILURE;
-    }
-
-    if (args->bzimage_size + args->initrd_size > args->size) {
-        BFDEBUG("setup_kernel: requested RAM is too small\n");
-        return FAILURE;
-    }
-
-    if (hdr->header != 0x53726448) {
-        BFDEBUG("setup_kernel: bzImage does not contain magic number\n");
-        return FAILURE;
-    }
-
-    if (hdr->version < 0x020d) {
-        BFDEBUG("setup_kernel: unsupported bzImage protocol\n");
-        return FAILURE;
-    }
-
-    if (hdr->code32_start != 0x100000) {
-        BFDEBUG("setup_kernel: unsupported bzImage start location\n");
-        return FAILURE;
-    }
-
-    vm->size = args->size;
-    vm->addr = bfalloc_buffer(char, vm->size);
-
-    if (vm->addr == 0) {
-        BFDEBUG("setup_kernel: failed to alloc ram\n");
-        return FAILURE;
-    }
-
     kernel_offset = ((hdr->setup_sects + 1) * 512);
 
-    if (kernel_offset > args->bzimage_size) {
-        BFDEBUG("setup_kernel: corrupt setup_sects\n");
-        return FAILURE;
-    }
-
     // TODO
     //
     // We need to clean up this implementation with a lot more checks
@@ -435,16 +474,18 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
         return ret;
     }
 
-    ret = donate_buffer(vm, vm->addr, 0x100000, vm->size);
+    ret = platform_memcpy(&vm->params->hdr, HDR_SIZE, hdr, HDR_SIZE, HDR_SIZE);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_boot_params(vm, args, hdr);
+    ret = load_cmdline(vm, args);
     if (ret != SUCCESS) {
         return ret;
     }
 
+    vm->params->hdr.type_of_loader = 0xFF;
+
     // TODO
     //
     // Check initrd size and location to ensure they are in the 32bit
@@ -457,25 +498,6 @@ setup_kernel(struct vm_t *vm, struct create_vm_from_bzimage_args *args)
     return SUCCESS;
 }
 
-static status_t
-setup_bios_ram(struct vm_t *vm)
-{
-    status_t ret;
-
-    vm->bios_ram = bfalloc_buffer(void, BIOS_RAM_SIZE);
-    if (vm->bios_ram == 0) {
-        BFDEBUG("setup_bios_ram: failed to alloc bios ram\n");
-        return FAILURE;
-    }
-
-    ret = donate_buffer(vm, vm->bios_ram, BIOS_RAM_ADDR, BIOS_RAM_SIZE);
-    if (ret != SUCCESS) {
-        return ret;
-    }
-
-    return SUCCESS;
-}
-
 /* -------------------------------------------------------------------------- */
 /* Initial Register State                                                     */
 /* -------------------------------------------------------------------------- */
@@ -527,61 +549,88 @@ setup_32bit_register_state(struct vm_t *vm)
      * The instructions for the initial register state for a 32bit Linux
      * kernel can be found here
      * https://www.kernel.org/doc/Documentation/x86/boot.txt
+     *
+     * Each register is set using its own hypercall, so instead of taking a
+     * VM exit per register, the hypercalls are batched into a single
+     * multicall.
      */
 
+    uint64_t i;
+    uint64_t num = 0;
     status_t ret = SUCCESS;
+    struct hypercall_multicall_entry *entries = 0;
+
+    entries = bfalloc_page(struct hypercall_multicall_entry);
+    if (entries == 0) {
+        BFDEBUG("setup_32bit_register_state: failed to alloc multicall entries\n");
+        return FAILURE;
+    }
+
+#define set_reg(reg, val)                                                       \
+    hypercall_multicall_entry__set(                                             \
+        &entries[num++], hypercall_enum_domain_op__set_ ## reg, vm->domainid, val, 0)
+
+    set_reg(rip, 0x100000);
+    set_reg(rsi, BOOT_PARAMS_PAGE_GPA);
+
+    set_reg(gdt_base, INITIAL_GDT_GPA);
+    set_reg(gdt_limit, 32);
 
-    ret |= hypercall_domain_op__set_rip(vm->domainid, 0x100000);
-    ret |= hypercall_domain_op__set_rsi(vm->domainid, BOOT_PARAMS_PAGE_GPA);
+    set_reg(cr0, 0x10037);
+    set_reg(cr3, 0x0);
+    set_reg(cr4, 0x02000);
 
-    ret |= hypercall_domain_op__set_gdt_base(vm->domainid, INITIAL_GDT_GPA);
-    ret |= hypercall_domain_op__set_gdt_limit(vm->domainid, 32);
+    set_reg(es_selector, 0x18);
+    set_reg(es_base, 0x0);
+    set_reg(es_limit, 0xFFFFFFFF);
+    set_reg(es_access_rights, 0xc093);
 
-    ret |= hypercall_domain_op__set_cr0(vm->domainid, 0x10037);
-    ret |= hypercall_domain_op__set_cr3(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cr4(vm->domainid, 0x02000);
+    set_reg(cs_selector, 0x10);
+    set_reg(cs_base, 0x0);
+    set_reg(cs_limit, 0xFFFFFFFF);
+    set_reg(cs_access_rights, 0xc09b);
 
-    ret |= hypercall_domain_op__set_es_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_es_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_es_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_es_access_rights(vm->domainid, 0xc093);
+    set_reg(ss_selector, 0x18);
+    set_reg(ss_base, 0x0);
+    set_reg(ss_limit, 0xFFFFFFFF);
+    set_reg(ss_access_rights, 0xc093);
 
-    ret |= hypercall_domain_op__set_cs_selector(vm->domainid, 0x10);
-    ret |= hypercall_domain_op__set_cs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_cs_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_cs_access_rights(vm->domainid, 0xc09b);
+    set_reg(ds_selector, 0x18);
+    set_reg(ds_base, 0x0);
+    set_reg(ds_limit, 0xFFFFFFFF);
+    set_reg(ds_access_rights, 0xc093);
 
-    ret |= hypercall_domain_op__set_ss_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ss_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ss_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ss_access_rights(vm->domainid, 0xc093);
+    set_reg(fs_selector, 0x0);
+    set_reg(fs_base, 0x0);
+    set_reg(fs_limit, 0x0);
+    set_reg(fs_access_rights, 0x10000);
 
-    ret |= hypercall_domain_op__set_ds_selector(vm->domainid, 0x18);
-    ret |= hypercall_domain_op__set_ds_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ds_limit(vm->domainid, 0xFFFFFFFF);
-    ret |= hypercall_domain_op__set_ds_access_rights(vm->domainid, 0xc093);
+    set_reg(gs_selector, 0x0);
+    set_reg(gs_base, 0x0);
+    set_reg(gs_limit, 0x0);
+    set_reg(gs_access_rights, 0x10000);
 
-    ret |= hypercall_domain_op__set_fs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_fs_access_rights(vm->domainid, 0x10000);
+    set_reg(tr_selector, 0x0);
+    set_reg(tr_base, 0x0);
+    set_reg(tr_limit, 0x0);
+    set_reg(tr_access_rights, 0x008b);
 
-    ret |= hypercall_domain_op__set_gs_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_gs_access_rights(vm->domainid, 0x10000);
+    set_reg(ldtr_selector, 0x0);
+    set_reg(ldtr_base, 0x0);
+    set_reg(ldtr_limit, 0x0);
+    set_reg(ldtr_access_rights, 0x10000);
 
-    ret |= hypercall_domain_op__set_tr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_tr_access_rights(vm->domainid, 0x008b);
+    set_reg(ia32_pat, 0x0606060606060606);
 
-    ret |= hypercall_domain_op__set_ldtr_selector(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_base(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_limit(vm->domainid, 0x0);
-    ret |= hypercall_domain_op__set_ldtr_access_rights(vm->domainid, 0x10000);
+#undef set_reg
 
-    ret |= hypercall_domain_op__set_ia32_pat(vm->domainid, 0x0606060606060606);
+    ret = hypercall_multicall_op(entries, num);
+
+    for (i = 0; i < num; i++) {
+        ret |= entries[i].ret;
+    }
+
+    platform_free_rw(entries, BAREFLANK_PAGE_SIZE);
 
     if (ret != SUCCESS) {
         BFDEBUG("setup_entry: setup_32bit_register_state failed\n");
@@ -600,76 +649,205 @@ setup_32bit_register_state(struct vm_t *vm)
 /* Implementation                                                             */
 /* -------------------------------------------------------------------------- */
 
-int64_t
-common_create_vm_from_bzimage(
-    struct create_vm_from_bzimage_args *args)
+/**
+ * Note:
+ *
+ * Most of the time it takes to create a VM is spent before the kernel is
+ * ever looked at (creating the domain, allocating and donating its RAM and
+ * setting up its initial register state). common_prepare_vm does all of
+ * this ahead of time, and places the VM in a pool of prepared VMs. When
+ * common_create_vm_from_bzimage is asked for a VM with the same amount of
+ * RAM as a prepared VM, the prepared VM is taken from the pool, and only the
+ * kernel, initrd and command line are loaded.
+ */
+
+static status_t
+prepare_vm(struct vm_t *vm, uint64_t size)
 {
     status_t ret;
-    struct vm_t *vm = acquire_vm();
-
-    args->domainid = INVALID_DOMAINID;
-
-    if (bfack() == 0) {
-        return COMMON_NO_HYPERVISOR;
-    }
 
     vm->domainid = hypercall_domain_op__create_domain();
     if (vm->domainid == INVALID_DOMAINID) {
         BFDEBUG("__domain_op__create_domain failed\n");
-        return COMMON_CREATE_VM_FROM_BZIMAGE_FAILED;
+        return FAILURE;
     }
 
-    ret = setup_kernel(vm, args);
+    ret = setup_ram(vm, size);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_bios_ram(vm);
+    ret = setup_boot_params(vm);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_32bit_register_state(vm);
+    ret = setup_bios_ram(vm);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_uart(vm, args->uart);
+    ret = setup_32bit_register_state(vm);
     if (ret != SUCCESS) {
         return ret;
     }
 
-    ret = setup_pt_uart(vm, args->pt_uart);
+    return SUCCESS;
+}
+
+/**
+ * Note:
+ *
+ * This is used both to destroy a VM, and to clean up after a VM that could
+ * not be prepared or created, in which case the domain might not exist,
+ * and some of the VM's memory might not have been allocated. If the domain
+ * cannot be destroyed, the VM (and its memory) is leaked, as the VMM might
+ * still be using the memory that was donated to it.
+ */
+
+static status_t
+destroy_vm(struct vm_t *vm)
+{
+    status_t ret;
+
+    if (vm->domainid != INVALID_DOMAINID) {
+        ret = hypercall_domain_op__destroy_domain(vm->domainid);
+        if (ret != SUCCESS) {
+            BFDEBUG("__domain_op__destroy_domain failed\n");
+            return ret;
+        }
+    }
+
+    platform_free_rw(vm->bios_ram, BIOS_RAM_SIZE);
+    platform_free_rw(vm->params, BAREFLANK_PAGE_SIZE);
+    platform_free_rw(vm->cmdline, BAREFLANK_PAGE_SIZE);
+    platform_free_rw(vm->gdt, BAREFLANK_PAGE_SIZE);
+    platform_free_rw(vm->addr, vm->size);
+
+    release_vm(vm);
+    return SUCCESS;
+}
+
+static struct vm_t *
+take_prepared_vm(uint64_t size)
+{
+    int64_t i;
+    struct vm_t *vm = 0;
+
+    platform_acquire_mutex();
+
+    for (i = 0; i < MAX_VMS; i++) {
+        if (g_vms[i].used != 0 && g_vms[i].prepared != 0 && g_vms[i].size == size) {
+            vm = &g_vms[i];
+            vm->prepared = 0;
+            break;
+        }
+    }
+
+    platform_release_mutex();
+    return vm;
+}
+
+int64_t
+common_prepare_vm(struct prepare_vm_args *args)
+{
+    status_t ret;
+    struct vm_t *vm = 0;
+
+    args->domainid = INVALID_DOMAINID;
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    if (args->size == 0 || (args->size & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+        BFDEBUG("common_prepare_vm: invalid RAM size\n");
+        return COMMON_PREPARE_VM_FAILED;
+    }
+
+    vm = acquire_vm();
+    if (vm == 0) {
+        return COMMON_PREPARE_VM_FAILED;
+    }
+
+    ret = prepare_vm(vm, args->size);
     if (ret != SUCCESS) {
-        return ret;
+        destroy_vm(vm);
+        return COMMON_PREPARE_VM_FAILED;
     }
 
+    platform_acquire_mutex();
+    vm->prepared = 1;
+    platform_release_mutex();
+
     args->domainid = vm->domainid;
     return SUCCESS;
 }
 
 int64_t
-common_destroy(uint64_t domainid)
+common_create_vm_from_bzimage(
+    struct create_vm_from_bzimage_args *args)
 {
     status_t ret;
-    struct vm_t *vm = get_vm(domainid);
+    struct vm_t *vm = 0;
+
+    args->domainid = INVALID_DOMAINID;
 
     if (bfack() == 0) {
         return COMMON_NO_HYPERVISOR;
     }
 
-    ret = hypercall_domain_op__destroy_domain(vm->domainid);
+    ret = check_kernel(args);
     if (ret != SUCCESS) {
-        BFDEBUG("__domain_op__destroy_domain failed\n");
         return ret;
     }
 
-    platform_free_rw(vm->bios_ram, BIOS_RAM_SIZE);
-    platform_free_rw(vm->params, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->cmdline, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->gdt, BAREFLANK_PAGE_SIZE);
-    platform_free_rw(vm->addr, vm->size);
+    vm = take_prepared_vm(args->size);
+    if (vm == 0) {
+        vm = acquire_vm();
+        if (vm == 0) {
+            return COMMON_CREATE_VM_FROM_BZIMAGE_FAILED;
+        }
 
-    release_vm(vm);
+        ret = prepare_vm(vm, args->size);
+        if (ret != SUCCESS) {
+            ret = COMMON_CREATE_VM_FROM_BZIMAGE_FAILED;
+            goto failed;
+        }
+    }
+
+    ret = load_kernel(vm, args);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_uart(vm, args->uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    ret = setup_pt_uart(vm, args->pt_uart);
+    if (ret != SUCCESS) {
+        goto failed;
+    }
+
+    args->domainid = vm->domainid;
     return SUCCESS;
+
+failed:
+
+    destroy_vm(vm);
+    return ret;
+}
+
+int64_t
+common_destroy(uint64_t domainid)
+{
+    struct vm_t *vm = get_vm(domainid);
+
+    if (bfack() == 0) {
+        return COMMON_NO_HYPERVISOR;
+    }
+
+    return destroy_vm(vm);
 }
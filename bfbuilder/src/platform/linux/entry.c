@@ -21,7 +21,13 @@
  */
 
 #include <linux/fs.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
 #include <linux/module.h>
+#include <linux/version.h>
+#include <linux/suspend.h>
 #include <linux/uaccess.h>
 #include <linux/miscdevice.h>
 
@@ -33,6 +39,245 @@
 #include <bfconstants.h>
 #include <bfplatform.h>
 
+/* -------------------------------------------------------------------------- */
+/* Suspend / Resume                                                           */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * While the host is suspended, the hypervisor is stopped and any vmcall
+ * returns SUSPEND. Instead of polling until the vmcall succeeds again,
+ * bfexec blocks on IOCTL_WAIT_FOR_RESUME, which returns as soon as the
+ * hypervisor has been restarted.
+ *
+ * The bareflank driver stops and starts the hypervisor from its own PM
+ * notifier (registered with the default priority of 0). To ensure the
+ * suspended flag covers the entire time the hypervisor is stopped, the flag
+ * is set by a notifier that runs before the bareflank driver's, and cleared
+ * by a notifier that runs after it.
+ */
+
+static int g_suspended = 0;
+static DECLARE_WAIT_QUEUE_HEAD(g_resume_wq);
+
+static int
+suspend_notifier(struct notifier_block *nb, unsigned long mode, void *data)
+{
+    switch (mode) {
+        case PM_HIBERNATION_PREPARE:
+        case PM_SUSPEND_PREPARE:
+            WRITE_ONCE(g_suspended, 1);
+            break;
+
+        default:
+            break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static int
+resume_notifier(struct notifier_block *nb, unsigned long mode, void *data)
+{
+    switch (mode) {
+        case PM_POST_HIBERNATION:
+        case PM_POST_SUSPEND:
+            WRITE_ONCE(g_suspended, 0);
+            wake_up_interruptible_all(&g_resume_wq);
+            break;
+
+        default:
+            break;
+    }
+
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block suspend_nb = {
+    .notifier_call = suspend_notifier,
+    .priority = 1
+};
+
+static struct notifier_block resume_nb = {
+    .notifier_call = resume_notifier,
+    .priority = -1
+};
+
+/* -------------------------------------------------------------------------- */
+/* Shared Memory                                                              */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Note:
+ *
+ * Memory that the VMM keeps mapped for a long time (e.g. a UART ring) cannot
+ * be ordinary userspace memory. mlock keeps pages resident, but it does not
+ * stop the kernel from migrating them (e.g. during compaction), after which
+ * the VMM would write into whatever now owns the old physical pages.
+ * Instead, userspace maps the builder device, which gives it physically
+ * contiguous kernel pages that are never moved, and then asks the builder to
+ * hand those pages to the VMM by physical address. Once the last mapping of
+ * the pages is gone, the builder takes the pages back from the VMM before
+ * they are freed. If the VMM will not give them back, they are leaked
+ * instead.
+ */
+
+#define MAX_SHARED_MEMORY_SIZE 0x100000
+
+#define SHARED_MEMORY_UNUSED 0
+#define SHARED_MEMORY_UART_RING 1
+#define SHARED_MEMORY_BUFFER 2
+
+struct shared_memory {
+    atomic_t refs;
+
+    void *virt;
+    uint64_t size;
+
+    int type;
+    domainid_t domainid;
+    uint64_t handle;
+};
+
+static DEFINE_MUTEX(g_shared_memory_mutex);
+
+static status_t
+release_shared_memory(struct shared_memory *shm)
+{
+    status_t ret = SUCCESS;
+
+    switch (shm->type) {
+        case SHARED_MEMORY_UART_RING:
+            ret = hypercall_domain_op__set_uart_ring(shm->domainid, 0);
+            break;
+
+        case SHARED_MEMORY_BUFFER:
+            ret = hypercall_domain_op__unregister_buffer(shm->domainid, shm->handle);
+            break;
+
+        default:
+            break;
+    }
+
+    if (ret == SUCCESS) {
+        shm->type = SHARED_MEMORY_UNUSED;
+    }
+
+    return ret;
+}
+
+static void
+put_shared_memory(struct shared_memory *shm)
+{
+    status_t ret;
+
+    if (!atomic_dec_and_test(&shm->refs)) {
+        return;
+    }
+
+    mutex_lock(&g_shared_memory_mutex);
+    ret = release_shared_memory(shm);
+    mutex_unlock(&g_shared_memory_mutex);
+
+    if (ret != SUCCESS) {
+        BFALERT("the VMM did not release shared memory. leaking %llx bytes\n", shm->size);
+        return;
+    }
+
+    free_pages_exact(shm->virt, shm->size);
+    kfree(shm);
+}
+
+static void
+shared_memory_vma_open(struct vm_area_struct *vma)
+{
+    struct shared_memory *shm = vma->vm_private_data;
+    atomic_inc(&shm->refs);
+}
+
+static void
+shared_memory_vma_close(struct vm_area_struct *vma)
+{ put_shared_memory(vma->vm_private_data); }
+
+static const struct vm_operations_struct shared_memory_vm_ops = {
+    .open = shared_memory_vma_open,
+    .close = shared_memory_vma_close
+};
+
+/**
+ * Note:
+ *
+ * The reference that is returned keeps the memory from being freed (and
+ * taken back from the VMM) while an ioctl uses it, even if userspace unmaps
+ * it at the same time. It must be dropped with put_shared_memory.
+ */
+
+static struct shared_memory *
+get_shared_memory(void *ptr)
+{
+    struct vm_area_struct *vma;
+    struct shared_memory *shm = NULL;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    mmap_read_lock(current->mm);
+#else
+    down_read(&current->mm->mmap_sem);
+#endif
+
+    vma = find_vma(current->mm, (unsigned long)ptr);
+    if (vma != NULL && vma->vm_ops == &shared_memory_vm_ops &&
+        vma->vm_start == (unsigned long)ptr) {
+        shm = vma->vm_private_data;
+        atomic_inc(&shm->refs);
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+    mmap_read_unlock(current->mm);
+#else
+    up_read(&current->mm->mmap_sem);
+#endif
+
+    return shm;
+}
+
+static int
+dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+    struct shared_memory *shm;
+    uint64_t size = vma->vm_end - vma->vm_start;
+
+    if (vma->vm_pgoff != 0 || size > MAX_SHARED_MEMORY_SIZE) {
+        return -EINVAL;
+    }
+
+    shm = kzalloc(sizeof(struct shared_memory), GFP_KERNEL);
+    if (shm == NULL) {
+        return -ENOMEM;
+    }
+
+    shm->virt = alloc_pages_exact(size, GFP_KERNEL | __GFP_ZERO);
+    if (shm->virt == NULL) {
+        kfree(shm);
+        return -ENOMEM;
+    }
+
+    shm->size = size;
+    atomic_set(&shm->refs, 1);
+
+    if (remap_pfn_range(vma, vma->vm_start,
+                        virt_to_phys(shm->virt) >> PAGE_SHIFT, size, vma->vm_page_prot) != 0) {
+        free_pages_exact(shm->virt, size);
+        kfree(shm);
+        return -EAGAIN;
+    }
+
+    vma->vm_private_data = shm;
+    vma->vm_ops = &shared_memory_vm_ops;
+
+    return 0;
+}
+
 /* -------------------------------------------------------------------------- */
 /* Misc Device                                                                */
 /* -------------------------------------------------------------------------- */
@@ -151,6 +396,38 @@ failed:
     return BF_IOCTL_FAILURE;
 }
 
+static long
+ioctl_prepare_vm(struct prepare_vm_args *args)
+{
+    int64_t ret;
+    struct prepare_vm_args kern_args;
+
+    if (args == 0) {
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct prepare_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_PREPARE_VM: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = common_prepare_vm(&kern_args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_prepare_vm failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct prepare_vm_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_PREPARE_VM: failed to copy args to userspace\n");
+        common_destroy(kern_args.domainid);
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 ioctl_destroy(domainid_t *args)
 {
@@ -172,6 +449,123 @@ ioctl_destroy(domainid_t *args)
     return BF_IOCTL_SUCCESS;
 }
 
+static long
+ioctl_set_uart_ring(struct set_uart_ring_args *args)
+{
+    int64_t ret;
+    status_t status = FAILURE;
+    struct shared_memory *shm;
+    struct set_uart_ring_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct set_uart_ring_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_SET_UART_RING: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    shm = get_shared_memory(kern_args.ring);
+    if (shm == NULL) {
+        BFALERT("IOCTL_SET_UART_RING: the ring was not mapped from the builder\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    if (shm->size < sizeof(struct boxy_uart_ring)) {
+        BFALERT("IOCTL_SET_UART_RING: the ring is too small\n");
+        put_shared_memory(shm);
+        return BF_IOCTL_FAILURE;
+    }
+
+    mutex_lock(&g_shared_memory_mutex);
+
+    if (shm->type == SHARED_MEMORY_UNUSED) {
+        status = hypercall_domain_op__set_uart_ring(
+                     kern_args.domainid, virt_to_phys(shm->virt));
+    }
+
+    if (status == SUCCESS) {
+        shm->type = SHARED_MEMORY_UART_RING;
+        shm->domainid = kern_args.domainid;
+    }
+
+    mutex_unlock(&g_shared_memory_mutex);
+    put_shared_memory(shm);
+
+    if (status != SUCCESS) {
+        BFDEBUG("hypercall_domain_op__set_uart_ring failed\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_register_buffer(struct register_buffer_args *args)
+{
+    int64_t ret;
+    struct shared_memory *shm;
+    struct register_buffer_args kern_args;
+
+    ret = copy_from_user(&kern_args, args, sizeof(struct register_buffer_args));
+    if (ret != 0) {
+        BFALERT("IOCTL_REGISTER_BUFFER: failed to copy args from userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    shm = get_shared_memory(kern_args.buffer);
+    if (shm == NULL) {
+        BFALERT("IOCTL_REGISTER_BUFFER: the buffer was not mapped from the builder\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    mutex_lock(&g_shared_memory_mutex);
+
+    kern_args.handle = INVALID_BUFFER;
+    if (shm->type == SHARED_MEMORY_UNUSED) {
+        kern_args.handle = hypercall_domain_op__register_buffer(
+                               kern_args.domainid, virt_to_phys(shm->virt), shm->size);
+    }
+
+    if (kern_args.handle != INVALID_BUFFER) {
+        shm->type = SHARED_MEMORY_BUFFER;
+        shm->domainid = kern_args.domainid;
+        shm->handle = kern_args.handle;
+    }
+
+    mutex_unlock(&g_shared_memory_mutex);
+    put_shared_memory(shm);
+
+    if (kern_args.handle == INVALID_BUFFER) {
+        BFDEBUG("hypercall_domain_op__register_buffer failed\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    ret = copy_to_user(args, &kern_args, sizeof(struct register_buffer_args));
+    if (ret != 0) {
+
+        /**
+         * Note:
+         *
+         * The buffer stays registered until userspace unmaps it, which it
+         * will do once it sees that the ioctl failed.
+         */
+
+        BFALERT("IOCTL_REGISTER_BUFFER: failed to copy args to userspace\n");
+        return BF_IOCTL_FAILURE;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
+static long
+ioctl_wait_for_resume(void)
+{
+    if (wait_event_interruptible(g_resume_wq, READ_ONCE(g_suspended) == 0) != 0) {
+        return -ERESTARTSYS;
+    }
+
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 dev_unlocked_ioctl(
     struct file *file, unsigned int cmd, unsigned long arg)
@@ -183,6 +577,18 @@ dev_unlocked_ioctl(
         case IOCTL_DESTROY:
             return ioctl_destroy((domainid_t *)arg);
 
+        case IOCTL_WAIT_FOR_RESUME:
+            return ioctl_wait_for_resume();
+
+        case IOCTL_PREPARE_VM:
+            return ioctl_prepare_vm((struct prepare_vm_args *)arg);
+
+        case IOCTL_SET_UART_RING:
+            return ioctl_set_uart_ring((struct set_uart_ring_args *)arg);
+
+        case IOCTL_REGISTER_BUFFER:
+            return ioctl_register_buffer((struct register_buffer_args *)arg);
+
         default:
             return -EINVAL;
     }
@@ -191,6 +597,7 @@ dev_unlocked_ioctl(
 static struct file_operations fops = {
     .open = dev_open,
     .release = dev_release,
+    .mmap = dev_mmap,
     .unlocked_ioctl = dev_unlocked_ioctl
 };
 
@@ -215,12 +622,31 @@ dev_init(void)
         return -EPERM;
     }
 
+    if (register_pm_notifier(&suspend_nb) != 0) {
+        BFALERT("register_pm_notifier failed\n");
+        misc_deregister(&builder_dev);
+        return -EPERM;
+    }
+
+    if (register_pm_notifier(&resume_nb) != 0) {
+        BFALERT("register_pm_notifier failed\n");
+        unregister_pm_notifier(&suspend_nb);
+        misc_deregister(&builder_dev);
+        return -EPERM;
+    }
+
     return 0;
 }
 
 void
 dev_exit(void)
 {
+    unregister_pm_notifier(&resume_nb);
+    unregister_pm_notifier(&suspend_nb);
+
+    WRITE_ONCE(g_suspended, 0);
+    wake_up_interruptible_all(&g_resume_wq);
+
     misc_deregister(&builder_dev);
     return;
 }
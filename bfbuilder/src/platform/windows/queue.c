@@ -173,6 +173,21 @@ failed:
     return BF_IOCTL_FAILURE;
 }
 
+static long
+ioctl_prepare_vm(struct prepare_vm_args *args)
+{
+    int64_t ret;
+
+    ret = common_prepare_vm(args);
+    if (ret != BF_SUCCESS) {
+        BFDEBUG("common_prepare_vm failed: %llx\n", ret);
+        return BF_IOCTL_FAILURE;
+    }
+
+    BFDEBUG("IOCTL_PREPARE_VM: succeeded\n");
+    return BF_IOCTL_SUCCESS;
+}
+
 static long
 ioctl_destroy(domainid_t *args)
 {
@@ -262,6 +277,11 @@ bfbuilderEvtIoDeviceControl(
             ret = ioctl_destroy((domainid_t *)in);
             break;
 
+        case IOCTL_PREPARE_VM:
+            ret = ioctl_prepare_vm((struct prepare_vm_args *)in);
+            RtlCopyMemory(out, in, out_size);
+            break;
+
         default:
             goto IOCTL_FAILURE;
     }
@@ -51,7 +51,11 @@ parse_args(int argc, char *argv[])
     ("initrd", "The VM's initrd path", value<std::string>(), "[path]")
     ("cmdline", "Additional Linux command line arguments", value<std::string>(), "[text]")
     ("uart", "Give the VM an emulated UART", value<uint64_t>(), "[port #]")
-    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]");
+    ("pt_uart", "Pass-through a UART to VM", value<uint64_t>(), "[port #]")
+    ("timer_slack", "The VM's timer slack (Linux only)", value<uint64_t>(), "[nsec]")
+    ("cpu_quota", "The CPU time each vCPU can use per period", value<uint64_t>(), "[usec]")
+    ("cpu_period", "The CPU quota's period (default 100000)", value<uint64_t>(), "[usec]")
+    ("prepare", "Prepare VMs of --size for later use, and exit", value<uint64_t>(), "[count]");
 
     auto args = options.parse(argc, argv);
 
@@ -69,6 +73,14 @@ parse_args(int argc, char *argv[])
         verbose = true;
     }
 
+    if (args.count("prepare")) {
+        if (!args.count("size")) {
+            throw std::runtime_error("'prepare' requires 'size'");
+        }
+
+        return args;
+    }
+
     if (!args.count("bzimage")) {
         throw std::runtime_error("must specify 'bzimage'");
     }
@@ -77,6 +89,10 @@ parse_args(int argc, char *argv[])
         throw std::runtime_error("must specify 'uart' or 'pt_uart'");
     }
 
+    if (args.count("cpu_period") && !args.count("cpu_quota")) {
+        throw std::runtime_error("'cpu_period' requires 'cpu_quota'");
+    }
+
     return args;
 }
 
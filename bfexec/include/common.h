@@ -0,0 +1,183 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef COMMON_H
+#define COMMON_H
+
+#include <mutex>
+#include <memory>
+#include <functional>
+
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+#include <ioctl.h>
+
+// -----------------------------------------------------------------------------
+// Globals
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// This is the code that bfexec and bfexecd share. Both run each vCPU on a
+// thread of its own using the same loop, and both talk to the builder using
+// a single ioctl object.
+//
+
+extern std::unique_ptr<ioctl> ctl;
+
+extern uint64_t g_tsc_freq_khz;
+extern uint64_t g_timer_slack;
+
+// -----------------------------------------------------------------------------
+// TSC
+// -----------------------------------------------------------------------------
+
+/// RDTSC
+///
+/// @expects none
+/// @ensures none
+///
+/// @return the current value of the TSC
+///
+uint64_t rdtsc();
+
+/// Init TSC
+///
+/// Gets the TSC frequency, which is needed to convert the TSC deadlines
+/// that the VMM returns when a guest yields. Throws if the TSC frequency
+/// is not known.
+///
+/// @expects none
+/// @ensures none
+///
+void init_tsc();
+
+/// TSC to Nanoseconds
+///
+/// @expects init_tsc() has been called
+/// @ensures none
+///
+/// @param tsc the number of TSC ticks to convert
+/// @return tsc in nanoseconds
+///
+uint64_t tsc_to_nsec(uint64_t tsc);
+
+// -----------------------------------------------------------------------------
+// Wall Clock
+// -----------------------------------------------------------------------------
+
+/// Set Wall Clock
+///
+/// Gives the host's wall clock (and the TSC it was read at) to the VMM.
+///
+/// @expects none
+/// @ensures none
+///
+/// @return true on success, false otherwise
+///
+bool set_wallclock();
+
+/// Wait For Resume
+///
+/// Blocks until the host has resumed from suspend, and then gives the VMM
+/// the host's wall clock again. On Windows, this only waits a bit, and the
+/// caller is expected to try again if the hypervisor is still suspended.
+///
+/// @expects none
+/// @ensures none
+///
+void wait_for_resume();
+
+// -----------------------------------------------------------------------------
+// vCPU Thread
+// -----------------------------------------------------------------------------
+
+/// vCPU Thread State
+///
+/// The state that is needed to kick a vCPU thread. The handle is only used
+/// (under the lock) while the thread is running, and a kick that arrives
+/// while the vCPU is executing is remembered so that the next sleep is
+/// skipped.
+///
+struct vcpu_thread_state {
+#ifdef __linux__
+    std::mutex mutex;
+    pthread_t handle{};
+    bool running{};
+#endif
+
+    bool kicked{};
+};
+
+/// vCPU Exit
+///
+/// Why run_vcpu stopped running the vCPU.
+///
+enum class vcpu_exit {
+    halted,
+    faulted
+};
+
+/// Setup Kick Signal Handler
+///
+/// Must be called once, before any vCPU thread is kicked.
+///
+/// @expects none
+/// @ensures none
+///
+void setup_kick_signal_handler();
+
+/// Kick vCPU
+///
+/// Wakes up the vCPU thread if it is sleeping, so that the vCPU is resumed
+/// right away instead of once the sleep is done.
+///
+/// @expects none
+/// @ensures none
+///
+/// @param state the state of the vCPU thread to kick
+///
+void kick_vcpu(vcpu_thread_state &state);
+
+/// Run vCPU
+///
+/// Runs the vCPU on the calling thread until it halts or faults. The
+/// provided function is called each time the vCPU returns to us (e.g. to
+/// check the UART ring's doorbell), so it should be cheap.
+///
+/// @expects none
+/// @ensures none
+///
+/// @param domainid the vCPU's domain (only used for error messages)
+/// @param vcpuid the vCPU to run
+/// @param state the state used to kick this thread
+/// @param on_return called each time the vCPU returns to us
+/// @return why the vCPU stopped
+///
+vcpu_exit run_vcpu(
+    domainid_t domainid,
+    vcpuid_t vcpuid,
+    vcpu_thread_state &state,
+    const std::function<void()> &on_return);
+
+#endif
@@ -26,9 +26,24 @@
 #include <vector>
 #include <fstream>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
 namespace bfn
 {
 
+// Note:
+//
+// The bzImage and initrd can be hundreds of MB, so on Linux, the file is
+// mapped (and prefaulted with MAP_POPULATE) instead of being read, and the
+// mapping is handed directly to the builder. If the file cannot be mapped,
+// or on other platforms, the file is read in a single read into a buffer.
+//
+
 class file
 {
     using pointer = const char *;
@@ -37,31 +52,107 @@ class file
 public:
 
     file(const std::string &filename) :
-        m_path{filename},
-        m_file{filename, std::ios::in | std::ios::binary},
-        m_data{std::istreambuf_iterator<char>(m_file), std::istreambuf_iterator<char>()}
-    { }
+        m_path{filename}
+    {
+        if (!this->map()) {
+            this->read();
+        }
+    }
 
     ~file()
-    { }
+    {
+#ifdef __linux__
+        if (m_map != nullptr) {
+            munmap(m_map, m_size);
+        }
+#endif
+    }
 
     pointer
     data() const noexcept
-    { return m_data.data(); }
+    { return m_map != nullptr ? static_cast<pointer>(m_map) : m_data.data(); }
 
     size_type
     size() const noexcept
-    { return m_data.size(); }
+    { return m_map != nullptr ? m_size : m_data.size(); }
 
     const std::string &
     path() const noexcept
     { return m_path; }
 
+private:
+
+    bool
+    map()
+    {
+#ifdef __linux__
+
+        auto fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st {};
+        if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+            close(fd);
+            return false;
+        }
+
+        auto size = static_cast<size_type>(st.st_size);
+        auto ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+
+        close(fd);
+
+        if (ptr == MAP_FAILED) {
+            return false;
+        }
+
+        madvise(ptr, size, MADV_SEQUENTIAL);
+
+        m_map = ptr;
+        m_size = size;
+
+        return true;
+
+#else
+        return false;
+#endif
+    }
+
+    void
+    read()
+    {
+        std::ifstream file{m_path, std::ios::in | std::ios::binary | std::ios::ate};
+        if (!file) {
+            return;
+        }
+
+        auto size = file.tellg();
+        if (size <= 0) {
+            return;
+        }
+
+        m_data.resize(static_cast<size_type>(size));
+
+        file.seekg(0);
+        file.read(m_data.data(), size);
+    }
+
 private:
 
     std::string m_path;
-    std::fstream m_file;
     std::vector<char> m_data;
+
+    void *m_map{};
+    size_type m_size{};
+
+public:
+
+    file(file &&) = delete;
+    file &operator=(file &&) = delete;
+
+    file(const file &) = delete;
+    file &operator=(const file &) = delete;
 };
 
 }
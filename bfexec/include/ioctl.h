@@ -91,6 +91,20 @@ public:
     ///
     void call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args);
 
+    /// Prepare VM
+    ///
+    /// Prepares a VM ahead of time (i.e. creates the domain, and gives it
+    /// its RAM and initial state) and places it in the builder's pool of
+    /// prepared VMs. The next VM that is created with the same amount of
+    /// RAM uses this VM, and only needs its kernel to be loaded.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to prepare the VM
+    ///
+    void call_ioctl_prepare_vm(prepare_vm_args &args);
+
     /// Destroy VM
     ///
     /// Destroys a VM given a domain ID
@@ -102,6 +116,71 @@ public:
     ///
     void call_ioctl_destroy(domainid_t domainid) noexcept;
 
+    /// Wait For Resume
+    ///
+    /// Blocks until the host has resumed and the hypervisor has been
+    /// restarted. If the host is not suspended, this returns right away.
+    /// This should be called whenever a VMCall returns SUSPEND. This is
+    /// currently only supported on Linux.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    void call_ioctl_wait_for_resume();
+
+    /// Set UART Ring
+    ///
+    /// Gives a domain's UART ring to the VMM. The ring must have been mapped
+    /// using map_shared_memory, and it is taken back from the VMM once it
+    /// is unmapped.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to set the UART ring
+    ///
+    void call_ioctl_set_uart_ring(set_uart_ring_args &args);
+
+    /// Register Buffer
+    ///
+    /// Registers a buffer with a domain, so that hypercalls can refer to it
+    /// by handle. The buffer must have been mapped using map_shared_memory,
+    /// and it is unregistered once it is unmapped.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param args the args needed to register the buffer
+    ///
+    void call_ioctl_register_buffer(register_buffer_args &args);
+
+    /// Map Shared Memory
+    ///
+    /// Maps memory from the builder that can be handed to the VMM. Unlike
+    /// ordinary (even locked) memory, the builder's memory is never moved
+    /// by the kernel, so the VMM can keep it mapped.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param size the number of bytes to map
+    /// @return the memory, or nullptr if it could not be mapped
+    ///
+    void *map_shared_memory(size_type size) noexcept;
+
+    /// Unmap Shared Memory
+    ///
+    /// Unmaps memory that was mapped using map_shared_memory. If the memory
+    /// was handed to the VMM, the builder takes it back from the VMM first.
+    ///
+    /// @expects none
+    /// @ensures none
+    ///
+    /// @param ptr the memory to unmap
+    /// @param size the number of bytes that were mapped
+    ///
+    void unmap_shared_memory(void *ptr, size_type size) noexcept;
+
     /// VMCall
     ///
     /// Performs a VMCall through the Bareflank Driver. If
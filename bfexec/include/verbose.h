@@ -44,4 +44,17 @@
         u = std::thread(uart_thread);                                                                                                       \
     }
 
+#define runstate_verbose()                                                                                                                  \
+    if (verbose) {                                                                                                                          \
+        struct boxy_runstate_info info {};                                                                                                  \
+        if (hypercall_vcpu_op__get_runstate(g_vcpuid, &info) == SUCCESS) {                                                                  \
+            std::cout << '\n';                                                                                                              \
+            std::cout << bfcolor_cyan    "vCPU run state:\n" bfcolor_end;                                                                   \
+            std::cout << bfcolor_magenta "--------------------------------------------------------------------------------\n" bfcolor_end;  \
+            std::cout << "   running" bfcolor_yellow " | " << bfcolor_green << tsc_to_nsec(info.time[BOXY_RUNSTATE_RUNNING]) / 1000000 << "ms" << bfcolor_end "\n"; \
+            std::cout << "  runnable" bfcolor_yellow " | " << bfcolor_green << tsc_to_nsec(info.time[BOXY_RUNSTATE_RUNNABLE]) / 1000000 << "ms" << bfcolor_end "\n"; \
+            std::cout << "   blocked" bfcolor_yellow " | " << bfcolor_green << tsc_to_nsec(info.time[BOXY_RUNSTATE_BLOCKED]) / 1000000 << "ms" << bfcolor_end "\n"; \
+        }                                                                                                                                   \
+    }
+
 #endif
@@ -0,0 +1,457 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <bfgsl.h>
+#include <bfdebug.h>
+#include <bftsc.h>
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+
+#ifdef __linux__
+#include <time.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#endif
+
+#include <common.h>
+
+using namespace std::chrono;
+
+std::unique_ptr<ioctl> ctl = std::make_unique<ioctl>();
+
+uint64_t g_tsc_freq_khz;
+uint64_t g_timer_slack = 1000;
+
+// -----------------------------------------------------------------------------
+// VMCall
+// -----------------------------------------------------------------------------
+
+uint64_t
+_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4) noexcept
+{ return ctl->call_ioctl_vmcall(r1, r2, r3, r4); }
+
+// -----------------------------------------------------------------------------
+// RDTSC
+// -----------------------------------------------------------------------------
+
+#ifdef WIN32
+#include <intrin.h>
+#endif
+
+#ifdef __CYGWIN__
+#define TIME_UTC 1
+#define timespec_get __timespec_get
+
+typedef int (* p_timespec_get)(void*, int);
+static p_timespec_get __timespec_get;
+
+void
+dl_timespec_get()
+{
+    timespec_get = (p_timespec_get) GetProcAddress(
+        LoadLibrary(TEXT("ucrtbase.dll")), "_timespec64_get");
+    if (!timespec_get) {
+        std::cerr << "win32 error: " << GetLastError() << "\n";
+        throw std::runtime_error("Failed to load timespec_get dynamically.");
+    }
+}
+#endif
+
+uint64_t
+rdtsc()
+{
+#ifdef WIN32
+    _mm_lfence();
+    return static_cast<uint64_t>(__rdtsc());
+#else
+    uint64_t hi, lo;
+    __asm__ __volatile__ ("lfence;rdtsc" : "=a"(lo), "=d"(hi));
+    return (hi << 32) | lo;
+#endif
+}
+
+void
+init_tsc()
+{
+#ifdef __CYGWIN__
+    dl_timespec_get();
+#endif
+
+    // Note:
+    //
+    // Boxy doesn't support pre-skylake CPUs because of unreliable tsc freq.
+    // The tsc freq is needed to convert the TSC deadlines that are returned
+    // by the VMM when a guest yields.
+    //
+
+    g_tsc_freq_khz = calibrate_tsc_freq_khz();
+    if (g_tsc_freq_khz == 0) {
+        throw std::runtime_error("missing tsc info. system not supported");
+    }
+}
+
+uint64_t
+tsc_to_nsec(uint64_t tsc)
+{
+    // Note:
+    //
+    // The TSC is split into whole milliseconds and a remainder so that the
+    // multiply does not overflow. This is only done once per sleep, so the
+    // divides are not a concern here, unlike in the VMM, which converts with
+    // the pvclock multiplier and shift instead (see vclock.cpp).
+    //
+
+    return ((tsc / g_tsc_freq_khz) * 1000000) +
+           (((tsc % g_tsc_freq_khz) * 1000000) / g_tsc_freq_khz);
+}
+
+// -----------------------------------------------------------------------------
+// Wall Clock
+// -----------------------------------------------------------------------------
+
+bool
+set_wallclock()
+{
+    struct timespec ts;
+    uint64_t initial_tsc = 0;
+    uint64_t current_tsc = 0;
+
+    // Note:
+    //
+    // We need to ensure that no interrupts fire between when we get the
+    // wallclock time and when we read TSC. Since we do not have control of
+    // interrupts, we will use a similar approach to how the CMOS wallclock
+    // time is read. Basically, you get the TSC twice, once before you get
+    // the time, and once after. This not only gives you the TSC value, but
+    // it also allows you to measure how long it took to get wallclock time.
+    // Once you have that you loop until the difference between these
+    // measurements is under a threshold, ensuring that you tighten up the
+    // measurements between the TSC and the wallclock. The actual TSC value
+    // that we give the the VMM is the average between the two.
+    //
+    // Also note that as stated in the VMM's notes, we require an invariant
+    // TSC which is why this is even possible. If the TSC is not invariant,
+    // the creation of the vCPU would have failed.
+    //
+
+    int diff1 = 0;
+    int diff2 = 0;
+
+    do {
+        diff2 = diff1;
+
+        initial_tsc = rdtsc();
+        timespec_get(&ts, TIME_UTC);
+        current_tsc = rdtsc();
+
+        diff1 = static_cast<int>(current_tsc - initial_tsc);
+    }
+    while(std::abs(diff1 - diff2) > 100);
+
+    // Note
+    //
+    // Now that we have the wallclock and the TSC associated with this
+    // wallclock, we need to give this information to the VMM so that it can
+    // use this information to calculate the current time.
+    //
+
+    auto ret = hypercall_vclock_op__set_host_wallclock(
+        ts.tv_sec, ts.tv_nsec, initial_tsc + static_cast<uint64_t>(diff1 / 2));
+
+    return ret == SUCCESS;
+}
+
+// Note:
+//
+// While the host is suspended, the hypervisor is stopped and all hypercalls
+// return SUSPEND. Instead of polling, we block in the builder driver until
+// the hypervisor has been restarted, and then provide the host wall clock
+// again (as the hypervisor resets it when it is stopped) so that the VMM can
+// resync the guest's clock without the guest having to return to us.
+//
+// The Windows builder cannot tell us when the hypervisor has been restarted,
+// so there we just wait a bit and let the caller try again, which is how
+// SUSPEND was handled before the builder could wait for us.
+//
+
+void
+wait_for_resume()
+{
+#ifdef __linux__
+    ctl->call_ioctl_wait_for_resume();
+
+    if (!set_wallclock()) {
+        std::cerr << "[WARNING]: failed to set the host wallclock on resume\n";
+    }
+#else
+    std::this_thread::sleep_for(milliseconds(250));
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Kick
+// -----------------------------------------------------------------------------
+
+static void
+kick_signal_handler(int sig)
+{ bfignored(sig); }
+
+void
+setup_kick_signal_handler()
+{
+#ifdef __linux__
+
+    // Note:
+    //
+    // SA_RESTART is not used so that the kick interrupts the vCPU thread's
+    // sleep (ppoll is never restarted anyways).
+    //
+
+    struct sigaction sa {};
+    sa.sa_handler = kick_signal_handler;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGUSR1, &sa, nullptr);
+
+#endif
+}
+
+void
+kick_vcpu(vcpu_thread_state &state)
+{
+    __atomic_store_n(&state.kicked, true, __ATOMIC_RELEASE);
+
+#ifdef __linux__
+    std::lock_guard lock(state.mutex);
+
+    if (state.running) {
+        pthread_kill(state.handle, SIGUSR1);
+    }
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// Sleep
+// -----------------------------------------------------------------------------
+
+static void
+set_timer_slack()
+{
+#ifdef __linux__
+
+    // Note:
+    //
+    // The timer slack is per thread, and the default is 50us, which is
+    // added to every sleep that a vCPU performs. This is set on each vCPU
+    // thread so that it can be tuned per VM.
+    //
+
+    if (prctl(PR_SET_TIMERSLACK, g_timer_slack, 0, 0, 0) != 0) {
+        std::cerr << "[WARNING]: failed to set timer slack\n";
+    }
+
+#endif
+}
+
+// Note:
+//
+// A kick sets the kicked flag and then signals the vCPU thread. The signal
+// is blocked on the vCPU thread, and is only unblocked (atomically) while
+// the thread sleeps in ppoll. This way, a kick that arrives after the flag
+// is checked, but before the thread goes to sleep, is left pending and
+// wakes up ppoll right away, instead of being lost (which is what happens
+// if the signal is delivered right before clock_nanosleep is called).
+// A kick that arrives while the vCPU is executing leaves the signal pending
+// as well, which at most causes the next sleep to check the flag twice.
+//
+
+#ifdef __linux__
+thread_local sigset_t t_sleep_mask{};
+#endif
+
+static void
+sleep_until_tsc(vcpu_thread_state &state, uint64_t deadline)
+{
+    if (__atomic_exchange_n(&state.kicked, false, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    auto tsc = rdtsc();
+
+    if (tsc >= deadline) {
+        std::this_thread::yield();
+        return;
+    }
+
+    auto nsec = tsc_to_nsec(deadline - tsc);
+
+#ifdef __linux__
+
+    // Note:
+    //
+    // The deadline is converted into an absolute CLOCK_MONOTONIC time once,
+    // right after the TSC is read. This way, signals (which restart the
+    // sleep) and the time it takes to get here do not cause us to sleep
+    // longer than the guest asked for.
+    //
+
+    struct timespec now {};
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    nsec += static_cast<uint64_t>(now.tv_nsec);
+
+    auto end_sec = now.tv_sec + static_cast<time_t>(nsec / 1000000000);
+    auto end_nsec = static_cast<long>(nsec % 1000000000);
+
+    while (true) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+
+        struct timespec ts {
+            end_sec - now.tv_sec, end_nsec - now.tv_nsec
+        };
+
+        if (ts.tv_nsec < 0) {
+            ts.tv_sec--;
+            ts.tv_nsec += 1000000000;
+        }
+
+        if (ts.tv_sec < 0) {
+            return;
+        }
+
+        if (ppoll(nullptr, 0, &ts, &t_sleep_mask) != -1 || errno != EINTR) {
+            return;
+        }
+
+        if (__atomic_exchange_n(&state.kicked, false, __ATOMIC_ACQ_REL)) {
+            return;
+        }
+    }
+
+#else
+    std::this_thread::sleep_for(nanoseconds(nsec));
+#endif
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Thread
+// -----------------------------------------------------------------------------
+
+static vcpu_exit
+run_vcpu_loop(
+    domainid_t domainid,
+    vcpuid_t vcpuid,
+    vcpu_thread_state &state,
+    const std::function<void()> &on_return)
+{
+    while (true) {
+        auto ret = hypercall_run_op(vcpuid, 0, 0);
+        on_return();
+
+        switch (run_op_ret_op(ret)) {
+            case hypercall_enum_run_op__continue:
+                continue;
+
+            case hypercall_enum_run_op__yield:
+                sleep_until_tsc(state, run_op_ret_arg(ret));
+                continue;
+
+            case hypercall_enum_run_op__set_wallclock:
+                if (!set_wallclock()) {
+                    std::cerr << "[0x" << std::hex << domainid << std::dec << "] ";
+                    std::cerr << "set_wallclock failed\n";
+                    return vcpu_exit::faulted;
+                }
+                continue;
+
+            case hypercall_enum_run_op__hlt:
+                return vcpu_exit::halted;
+
+            case hypercall_enum_run_op__fault:
+                std::cerr << "[0x" << std::hex << domainid << std::dec << "] ";
+                std::cerr << "vcpu fault: " << run_op_ret_arg(ret) << '\n';
+                return vcpu_exit::faulted;
+
+            default:
+
+                if (ret == SUSPEND) {
+                    wait_for_resume();
+                    continue;
+                }
+
+                std::cerr << "[0x" << std::hex << domainid << std::dec << "] ";
+                std::cerr << "unknown vcpu ret: " << run_op_ret_op(ret) << '\n';
+                return vcpu_exit::faulted;
+        }
+    }
+}
+
+vcpu_exit
+run_vcpu(
+    domainid_t domainid,
+    vcpuid_t vcpuid,
+    vcpu_thread_state &state,
+    const std::function<void()> &on_return)
+{
+    set_timer_slack();
+
+#ifdef __linux__
+
+    // Note:
+    //
+    // The vCPU thread records its own handle so that it can be kicked, and
+    // the handle is only used (under the lock) while the thread is running.
+    // The kick signal is blocked before the handle is published (see
+    // sleep_until_tsc for why).
+    //
+
+    sigset_t kick_mask;
+    sigemptyset(&kick_mask);
+    sigaddset(&kick_mask, SIGUSR1);
+
+    if (pthread_sigmask(SIG_BLOCK, &kick_mask, &t_sleep_mask) != 0) {
+        std::cerr << "[0x" << std::hex << domainid << std::dec << "] ";
+        std::cerr << "failed to block the kick signal\n";
+        return vcpu_exit::faulted;
+    }
+
+    sigdelset(&t_sleep_mask, SIGUSR1);
+
+    {
+        std::lock_guard lock(state.mutex);
+
+        state.handle = pthread_self();
+        state.running = true;
+    }
+
+    auto ___ = gsl::finally([&] {
+        std::lock_guard lock(state.mutex);
+        state.running = false;
+    });
+
+#endif
+
+    return run_vcpu_loop(domainid, vcpuid, state, on_return);
+}
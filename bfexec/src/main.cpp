@@ -24,19 +24,29 @@
 #include <bfstring.h>
 #include <bfaffinity.h>
 #include <bfbuilderinterface.h>
-#include <bftsc.h>
 
 #include <list>
+#include <array>
 #include <memory>
+#include <algorithm>
 #include <chrono>
+#include <mutex>
 #include <thread>
 #include <fstream>
+#include <condition_variable>
 #include <iostream>
 
+#ifdef __linux__
+#include <poll.h>
+#include <errno.h>
+#include <unistd.h>
+#endif
+
 #include <args.h>
 #include <cmdl.h>
 #include <file.h>
 #include <ioctl.h>
+#include <common.h>
 #include <verbose.h>
 
 using namespace std::chrono;
@@ -44,197 +54,208 @@ using namespace std::chrono;
 vcpuid_t g_vcpuid;
 domainid_t g_domainid;
 
-auto ctl = std::make_unique<ioctl>();
-
 // -----------------------------------------------------------------------------
-// VMCall
+// Wall Clock
 // -----------------------------------------------------------------------------
 
-uint64_t
-_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4) noexcept
-{ return ctl->call_ioctl_vmcall(r1, r2, r3, r4); }
+// Note:
+//
+// The host wall clock is shared by all of the guests, so instead of having
+// each vCPU ask for it (which costs a trip back to bfexec per vCPU), bfexec
+// sets it before the guest starts and then refreshes it periodically so that
+// it tracks any adjustments made to the host's clock (e.g. NTP).
+//
+
+constexpr const auto wallclock_refresh_period = seconds(60);
+
+bool g_process_wallclock = true;
+std::mutex g_wallclock_mutex;
+std::condition_variable g_wallclock_cv;
+
+void
+wallclock_thread()
+{
+    std::unique_lock lock(g_wallclock_mutex);
+
+    while (!g_wallclock_cv.wait_for(
+               lock, wallclock_refresh_period, [] { return !g_process_wallclock; })) {
+
+        if (!set_wallclock()) {
+            std::cerr << "[WARNING]: failed to refresh the host wallclock\n";
+        }
+    }
+}
 
 // -----------------------------------------------------------------------------
-// RDTSC
+// UART Thread
 // -----------------------------------------------------------------------------
 
-#ifdef WIN32
-#include <intrin.h>
-#endif
+// Note:
+//
+// The VMM writes the UART's output into a ring that is mapped from the
+// builder, and rings a doorbell in the ring each time it does. The doorbell
+// is checked by the vCPU thread each time the vCPU returns to us, which is
+// cheap (no hypercall), and if it is set, the UART thread is woken up to
+// drain the ring. If the ring cannot be set up, we fall back to polling the
+// UART with dump_uart.
+//
+
+constexpr const auto uart_ring_timeout = seconds(1);
 
-#ifdef __CYGWIN__
-#define TIME_UTC 1
-#define timespec_get __timespec_get
+bool g_process_uart = true;
+std::mutex g_uart_mutex;
+std::condition_variable g_uart_cv;
 
-typedef int (* p_timespec_get)(void*, int);
-static p_timespec_get __timespec_get;
+struct boxy_uart_ring *g_uart_ring{};
 
 void
-dl_timespec_get()
+uart_doorbell()
 {
-    timespec_get = (p_timespec_get) GetProcAddress(
-        LoadLibrary(TEXT("ucrtbase.dll")), "_timespec64_get");
-    if (!timespec_get) {
-        std::cerr << "win32 error: " << GetLastError() << "\n";
-        throw std::runtime_error("Failed to load timespec_get dynamically.");
+    if (g_uart_ring == nullptr) {
+        return;
+    }
+
+    if (__atomic_load_n(&g_uart_ring->doorbell, __ATOMIC_ACQUIRE) != 0) {
+        std::lock_guard lock(g_uart_mutex);
+        g_uart_cv.notify_one();
     }
 }
-#endif
 
-inline uint64_t
-rdtsc()
+bool
+setup_uart_ring()
 {
-#ifdef WIN32
-    _mm_lfence();
-    return static_cast<uint64_t>(__rdtsc());
-#else
-    uint64_t hi, lo;
-    __asm__ __volatile__ ("lfence;rdtsc" : "=a"(lo), "=d"(hi));
-    return (hi << 32) | lo;
-#endif
+    auto ptr = ctl->map_shared_memory(sizeof(struct boxy_uart_ring));
+    if (ptr == nullptr) {
+        return false;
+    }
+
+    auto ring = static_cast<struct boxy_uart_ring *>(ptr);
+
+    try {
+        set_uart_ring_args args{g_domainid, ring};
+        ctl->call_ioctl_set_uart_ring(args);
+    }
+    catch (...) {
+        ctl->unmap_shared_memory(ptr, sizeof(struct boxy_uart_ring));
+        return false;
+    }
+
+    __atomic_store_n(&g_uart_ring, ring, __ATOMIC_RELEASE);
+    return true;
 }
 
 void
-init_tsc()
+release_uart_ring()
 {
-#ifdef __CYGWIN__
-    dl_timespec_get();
-#endif
-
     // Note:
     //
-    // Boxy doesn't support pre-skylake CPUs because of unreliable tsc freq.
-    // We don't actually need the tsc freq info here but we can use it to
-    // check whether the CPU is supported.
-    if (!calibrate_tsc_freq_khz()) {
-        throw std::runtime_error("missing tsc info. system not supported");
-    }
-}
+    // Unmapping the ring is all that is needed, as the builder takes the
+    // ring back from the VMM before the ring's memory is freed.
+    //
 
-// -----------------------------------------------------------------------------
-// Wall Clock
-// -----------------------------------------------------------------------------
+    auto ring = __atomic_exchange_n(&g_uart_ring, nullptr, __ATOMIC_ACQ_REL);
+    ctl->unmap_shared_memory(ring, sizeof(struct boxy_uart_ring));
+}
 
-bool
-set_wallclock()
+void
+drain_uart_ring()
 {
-    struct timespec ts;
-    uint64_t initial_tsc = 0;
-    uint64_t current_tsc = 0;
+    auto ring = g_uart_ring;
 
     // Note:
     //
-    // We need to ensure that no interrupts fire between when we get the
-    // wallclock time and when we read TSC. Since we do not have control of
-    // interrupts, we will use a similar approach to how the CMOS wallclock
-    // time is read. Basically, you get the TSC twice, once before you get
-    // the time, and once after. This not only gives you the TSC value, but
-    // it also allows you to measure how long it took to get wallclock time.
-    // Once you have that you loop until the difference between these
-    // measurements is under a threshold, ensuring that you tighten up the
-    // measurements between the TSC and the wallclock. The actual TSC value
-    // that we give the the VMM is the average between the two.
+    // The doorbell is cleared with an exchange (which is a full barrier) so
+    // that prod cannot be read before the doorbell is cleared, otherwise we
+    // could miss output written by the VMM right before it rang again.
     //
-    // Also note that as stated in the VMM's notes, we require an invariant
-    // TSC which is why this is even possible. If the TSC is not invariant,
-    // the creation of the vCPU would have failed.
-    //
-
-    int diff1 = 0;
-    int diff2 = 0;
 
-    do {
-        diff2 = diff1;
+    __atomic_exchange_n(&ring->doorbell, 0, __ATOMIC_SEQ_CST);
 
-        initial_tsc = rdtsc();
-        timespec_get(&ts, TIME_UTC);
-        current_tsc = rdtsc();
+    auto prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    auto cons = ring->cons;
 
-        diff1 = static_cast<int>(current_tsc - initial_tsc);
+    if (prod - cons > BOXY_UART_RING_SIZE) {
+        cons = prod - BOXY_UART_RING_SIZE;
     }
-    while(std::abs(diff1 - diff2) > 100);
 
-    // Note
-    //
-    // Now that we have the wallclock and the TSC associated with this
-    // wallclock, we need to give this information to the VMM so that it can
-    // use this information to calculate the current time.
-    //
+    while (cons != prod) {
+        auto index = cons & (BOXY_UART_RING_SIZE - 1);
+        auto bytes = std::min(prod - cons, BOXY_UART_RING_SIZE - index);
 
-    status_t ret = 0;
-
-    ret |= hypercall_vclock_op__set_host_wallclock_rtc(
-        g_vcpuid, ts.tv_sec, ts.tv_nsec);
-    ret |= hypercall_vclock_op__set_host_wallclock_tsc(
-        g_vcpuid, initial_tsc + static_cast<uint64_t>(diff1 / 2));
+        std::cout.write(&ring->data[index], gsl::narrow_cast<int>(bytes));
+        cons += bytes;
+    }
 
-    return ret == SUCCESS;
+    __atomic_store_n(&ring->cons, cons, __ATOMIC_RELEASE);
+    std::cout.flush();
 }
 
-// -----------------------------------------------------------------------------
-// vCPU Thread
-// -----------------------------------------------------------------------------
+// Note:
+//
+// When polling, the buffer that dump_uart writes into is mapped from the
+// builder and registered with the VMM once, so that it does not have to be
+// mapped on every poll. If it cannot be registered, a buffer on the stack is
+// given to the VMM each time instead.
+//
+
+char *g_uart_buffer{};
+uint64_t g_uart_buffer_handle{INVALID_BUFFER};
 
 void
-vcpu_thread(vcpuid_t vcpuid)
+setup_uart_buffer()
 {
-    while (true) {
-        auto ret = hypercall_run_op(vcpuid, 0, 0);
-
-        switch (run_op_ret_op(ret)) {
-            case hypercall_enum_run_op__continue:
-                continue;
-
-            case hypercall_enum_run_op__yield:
-                if (auto nsec = run_op_ret_arg(ret); nsec > 0) {
-                    std::this_thread::sleep_for(nanoseconds(nsec));
-                }
-                else {
-                    std::this_thread::yield();
-                }
-                continue;
+    auto ptr = ctl->map_shared_memory(UART_MAX_BUFFER);
+    if (ptr == nullptr) {
+        return;
+    }
 
-            case hypercall_enum_run_op__set_wallclock:
-                if (!set_wallclock()) {
-                    std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
-                    std::cerr << "set_wallclock failed\n";
-                    return;
-                }
-                continue;
+    try {
+        register_buffer_args args{g_domainid, ptr, INVALID_BUFFER};
+        ctl->call_ioctl_register_buffer(args);
 
-            case hypercall_enum_run_op__hlt:
-                return;
+        g_uart_buffer = static_cast<char *>(ptr);
+        g_uart_buffer_handle = args.handle;
+    }
+    catch (...) {
+        ctl->unmap_shared_memory(ptr, UART_MAX_BUFFER);
+    }
+}
 
-            case hypercall_enum_run_op__fault:
-                std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
-                std::cerr << "vcpu fault: " << run_op_ret_arg(ret) << '\n';
-                return;
+void
+release_uart_buffer()
+{
+    if (g_uart_buffer_handle == INVALID_BUFFER) {
+        return;
+    }
 
-            default:
+    // Note:
+    //
+    // Unmapping the buffer is all that is needed, as the builder unregisters
+    // the buffer before the buffer's memory is freed.
+    //
 
-                if (ret == SUSPEND) {
-                    std::this_thread::sleep_for(milliseconds(250));
-                    continue;
-                }
+    ctl->unmap_shared_memory(g_uart_buffer, UART_MAX_BUFFER);
 
-                std::cerr << "[0x" << std::hex << vcpuid << std::dec << "] ";
-                std::cerr << "unknown vcpu ret: " << run_op_ret_op(ret) << '\n';
-                return;
-        }
-    }
+    g_uart_buffer = nullptr;
+    g_uart_buffer_handle = INVALID_BUFFER;
 }
 
-// -----------------------------------------------------------------------------
-// UART Thread
-// -----------------------------------------------------------------------------
-
-bool g_process_uart = true;
-
 bool
 update_output()
 {
-    std::array<char, UART_MAX_BUFFER> buffer{};
-    auto size = hypercall_domain_op__dump_uart(g_domainid, buffer.data());
+    std::array<char, UART_MAX_BUFFER> stack_buffer{};
+
+    auto buffer = stack_buffer.data();
+    uint64_t size;
+
+    if (g_uart_buffer_handle != INVALID_BUFFER) {
+        buffer = g_uart_buffer;
+        size = hypercall_domain_op__dump_uart_buffer(
+                   g_domainid, g_uart_buffer_handle);
+    }
+    else {
+        size = hypercall_domain_op__dump_uart(g_domainid, buffer);
+    }
 
     if (size == FAILURE) {
         std::cerr << "[ERROR]: dump uart failure!!!\n";
@@ -242,21 +263,56 @@ update_output()
     }
 
     if (size == SUSPEND) {
+        wait_for_resume();
         return true;
     }
 
-    std::cout.write(buffer.data(), gsl::narrow_cast<int>(size));
+    std::cout.write(buffer, gsl::narrow_cast<int>(size));
     return true;
 }
 
 void
 uart_thread()
 {
-    while (g_process_uart && update_output()) {
-        std::this_thread::sleep_for(milliseconds(100));
+    if (!setup_uart_ring()) {
+        setup_uart_buffer();
+
+        while (g_process_uart && update_output()) {
+            std::this_thread::sleep_for(milliseconds(100));
+        }
+
+        update_output();
+        release_uart_buffer();
+        return;
     }
 
-    update_output();
+    {
+        std::unique_lock lock(g_uart_mutex);
+
+        while (g_process_uart) {
+            g_uart_cv.wait_for(lock, uart_ring_timeout, [] {
+                return !g_process_uart ||
+                       __atomic_load_n(&g_uart_ring->doorbell, __ATOMIC_ACQUIRE) != 0;
+            });
+
+            drain_uart_ring();
+        }
+    }
+
+    drain_uart_ring();
+    release_uart_ring();
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Thread
+// -----------------------------------------------------------------------------
+
+vcpu_thread_state g_vcpu_thread_state;
+
+void
+vcpu_thread(vcpuid_t vcpuid)
+{
+    run_vcpu(g_domainid, vcpuid, g_vcpu_thread_state, uart_doorbell);
 }
 
 // -----------------------------------------------------------------------------
@@ -301,6 +357,126 @@ setup_kill_signal_handler(void)
 #endif
 }
 
+// -----------------------------------------------------------------------------
+// Input Thread
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Input from stdin is given to the guest's UART. The VMM raises a vIRQ in
+// the guest (if it enabled the UART's receive interrupt) the next time the
+// vCPU is resumed, which is why the vCPU thread is kicked after each write.
+//
+
+#ifdef __linux__
+std::array<int, 2> g_input_pipe{-1, -1};
+#endif
+
+void
+write_input(const char *buffer, uint64_t size)
+{
+    while (size > 0) {
+        auto ret = hypercall_domain_op__write_uart(g_domainid, buffer, size);
+
+        if (ret == SUSPEND) {
+            wait_for_resume();
+            continue;
+        }
+
+        if (ret == FAILURE) {
+            std::cerr << "[ERROR]: write uart failure!!!\n";
+            return;
+        }
+
+        kick_vcpu(g_vcpu_thread_state);
+
+        if (ret == 0) {
+            std::this_thread::sleep_for(milliseconds(1));
+            continue;
+        }
+
+        buffer += ret;
+        size -= ret;
+    }
+}
+
+void
+input_thread()
+{
+#ifdef __linux__
+
+    std::array<char, UART_MAX_BUFFER> buffer{};
+    std::array<struct pollfd, 2> fds{{
+        {STDIN_FILENO, POLLIN, 0},
+        {g_input_pipe.at(0), POLLIN, 0}
+    }};
+
+    while (true) {
+        if (poll(fds.data(), fds.size(), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return;
+        }
+
+        if (fds.at(1).revents != 0) {
+            return;
+        }
+
+        auto bytes = read(STDIN_FILENO, buffer.data(), buffer.size());
+        if (bytes <= 0) {
+            return;
+        }
+
+        write_input(buffer.data(), static_cast<uint64_t>(bytes));
+    }
+
+#endif
+}
+
+bool
+start_input_thread(std::thread &i)
+{
+#ifdef __linux__
+
+    if (pipe(g_input_pipe.data()) != 0) {
+        return false;
+    }
+
+    i = std::thread(input_thread);
+    return true;
+
+#else
+    bfignored(i);
+    return false;
+#endif
+}
+
+void
+stop_input_thread(std::thread &i)
+{
+#ifdef __linux__
+
+    if (!i.joinable()) {
+        return;
+    }
+
+    char c = 0;
+    if (write(g_input_pipe.at(1), &c, 1) != 1) {
+        std::cerr << "[ERROR]: failed to stop the input thread\n";
+    }
+
+    i.join();
+
+    close(g_input_pipe.at(0));
+    close(g_input_pipe.at(1));
+
+#else
+    bfignored(i);
+#endif
+}
+
 // -----------------------------------------------------------------------------
 // Attach to VM
 // -----------------------------------------------------------------------------
@@ -308,25 +484,51 @@ setup_kill_signal_handler(void)
 static int
 attach_to_vm(const args_type &args)
 {
-    bfignored(args);
-
     g_vcpuid = hypercall_vcpu_op__create_vcpu(g_domainid);
     if (g_vcpuid == INVALID_VCPUID) {
         throw std::runtime_error("__vcpu_op__create_vcpu failed");
     }
 
+    if (!set_wallclock()) {
+        throw std::runtime_error("set_wallclock failed");
+    }
+
+    std::thread w(wallclock_thread);
     std::thread t(vcpu_thread, g_vcpuid);
     std::thread u;
+    std::thread i;
 
     output_vm_uart_verbose();
 
+    if (verbose && args.count("uart")) {
+        if (!start_input_thread(i)) {
+            std::cerr << "[WARNING]: failed to start the input thread\n";
+        }
+    }
+
     t.join();
+    stop_input_thread(i);
+
+    {
+        std::lock_guard lock(g_wallclock_mutex);
+        g_process_wallclock = false;
+    }
+
+    g_wallclock_cv.notify_one();
+    w.join();
 
     if (verbose) {
-        g_process_uart = false;
+        {
+            std::lock_guard lock(g_uart_mutex);
+            g_process_uart = false;
+        }
+
+        g_uart_cv.notify_one();
         u.join();
     }
 
+    runstate_verbose();
+
     if (hypercall_vcpu_op__destroy_vcpu(g_vcpuid) != SUCCESS) {
         std::cerr << "__vcpu_op__destroy_vcpu failed\n";
     }
@@ -400,6 +602,63 @@ create_vm_from_bzimage(const args_type &args)
     g_domainid = ioctl_args.domainid;
 }
 
+static void
+set_cpu_quota(const args_type &args)
+{
+    if (!args.count("cpu_quota")) {
+        return;
+    }
+
+    uint64_t quota = args["cpu_quota"].as<uint64_t>();
+    uint64_t period = 100000;
+
+    if (args.count("cpu_period")) {
+        period = args["cpu_period"].as<uint64_t>();
+    }
+
+    if (quota == 0 || quota > period) {
+        throw cxxopts::OptionException("--cpu_quota must be in (0, period]");
+    }
+
+    auto ret = hypercall_domain_op__set_cpu_quota(
+        g_domainid,
+        (quota * g_tsc_freq_khz) / 1000,
+        (period * g_tsc_freq_khz) / 1000
+    );
+
+    if (ret != SUCCESS) {
+        throw std::runtime_error("set_cpu_quota failed");
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Prepare VMs
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Prepared VMs are kept by the builder until they are used, so that a VM
+// that is later created with the same --size only has to have its kernel,
+// initrd and command line loaded before it can start.
+//
+
+static int
+prepare_vms(const args_type &args)
+{
+    auto count = args["prepare"].as<uint64_t>();
+
+    for (uint64_t i = 0; i < count; i++) {
+        prepare_vm_args ioctl_args {};
+
+        ioctl_args.size = args["size"].as<uint64_t>();
+        ctl->call_ioctl_prepare_vm(ioctl_args);
+
+        std::cout << "prepared VM: " << ioctl_args.domainid << '\n';
+    }
+
+    return EXIT_SUCCESS;
+}
+
 // -----------------------------------------------------------------------------
 // Main Functions
 // -----------------------------------------------------------------------------
@@ -422,12 +681,22 @@ protected_main(const args_type &args)
         set_affinity(0);
     }
 
+    if (args.count("timer_slack")) {
+        g_timer_slack = args["timer_slack"].as<uint64_t>();
+    }
+
+    if (args.count("prepare")) {
+        return prepare_vms(args);
+    }
+
     create_vm_from_bzimage(args);
 
     auto __ = gsl::finally([&] {
         ctl->call_ioctl_destroy(g_domainid);
     });
 
+    set_cpu_quota(args);
+
     return attach_to_vm(args);
 }
 
@@ -435,6 +704,7 @@ int
 main(int argc, char *argv[])
 {
     setup_kill_signal_handler();
+    setup_kick_signal_handler();
 
     try {
         init_tsc();
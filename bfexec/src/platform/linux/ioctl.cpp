@@ -34,6 +34,13 @@ ioctl::call_ioctl_create_vm_from_bzimage(
     d->call_ioctl_create_vm_from_bzimage(args);
 }
 
+void
+ioctl::call_ioctl_prepare_vm(prepare_vm_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_prepare_vm(args);
+}
+
 void
 ioctl::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -41,6 +48,41 @@ ioctl::call_ioctl_destroy(domainid_t domainid) noexcept
     d->call_ioctl_destroy(domainid);
 }
 
+void
+ioctl::call_ioctl_wait_for_resume()
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_wait_for_resume();
+}
+
+void
+ioctl::call_ioctl_set_uart_ring(set_uart_ring_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_set_uart_ring(args);
+}
+
+void
+ioctl::call_ioctl_register_buffer(register_buffer_args &args)
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->call_ioctl_register_buffer(args);
+}
+
+void *
+ioctl::map_shared_memory(size_type size) noexcept
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    return d->map_shared_memory(size);
+}
+
+void
+ioctl::unmap_shared_memory(void *ptr, size_type size) noexcept
+{
+    auto d = static_cast<ioctl_private *>(m_d.get());
+    d->unmap_shared_memory(ptr, size);
+}
+
 uint64_t
 ioctl::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
 {
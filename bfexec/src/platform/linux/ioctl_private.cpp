@@ -32,8 +32,10 @@
 #include <bfgsl.h>
 #include <bfdriverinterface.h>
 
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/ioctl.h>
 
 // -----------------------------------------------------------------------------
@@ -90,6 +92,14 @@ ioctl_private::call_ioctl_create_vm_from_bzimage(
     }
 }
 
+void
+ioctl_private::call_ioctl_prepare_vm(prepare_vm_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_PREPARE_VM, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_PREPARE_VM");
+    }
+}
+
 void
 ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -98,6 +108,48 @@ ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
     }
 }
 
+void
+ioctl_private::call_ioctl_wait_for_resume()
+{
+    // Note:
+    //
+    // If the wait is interrupted by a signal, we simply return. The caller
+    // retries its hypercall, which will return SUSPEND again if the host has
+    // not yet resumed.
+    //
+
+    if (bfm_write_ioctl(fd2, IOCTL_WAIT_FOR_RESUME, nullptr) < 0 && errno != EINTR) {
+        throw std::runtime_error("ioctl failed: IOCTL_WAIT_FOR_RESUME");
+    }
+}
+
+void
+ioctl_private::call_ioctl_set_uart_ring(set_uart_ring_args &args)
+{
+    if (bfm_write_ioctl(fd2, IOCTL_SET_UART_RING, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_SET_UART_RING");
+    }
+}
+
+void
+ioctl_private::call_ioctl_register_buffer(register_buffer_args &args)
+{
+    if (bfm_write_read_ioctl(fd2, IOCTL_REGISTER_BUFFER, &args) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_REGISTER_BUFFER");
+    }
+}
+
+void *
+ioctl_private::map_shared_memory(std::size_t size) noexcept
+{
+    auto ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd2, 0);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+}
+
+void
+ioctl_private::unmap_shared_memory(void *ptr, std::size_t size) noexcept
+{ munmap(ptr, size); }
+
 uint64_t
 ioctl_private::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
 {
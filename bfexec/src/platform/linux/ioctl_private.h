@@ -32,7 +32,13 @@ public:
     ~ioctl_private() override;
 
     void call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &args);
+    void call_ioctl_prepare_vm(prepare_vm_args &args);
     void call_ioctl_destroy(domainid_t domainid) noexcept;
+    void call_ioctl_wait_for_resume();
+    void call_ioctl_set_uart_ring(set_uart_ring_args &args);
+    void call_ioctl_register_buffer(register_buffer_args &args);
+    void *map_shared_memory(std::size_t size) noexcept;
+    void unmap_shared_memory(void *ptr, std::size_t size) noexcept;
     uint64_t call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4);
 
 private:
@@ -136,6 +136,14 @@ ioctl_private::call_ioctl_create_vm_from_bzimage(create_vm_from_bzimage_args &ar
     }
 }
 
+void
+ioctl_private::call_ioctl_prepare_vm(prepare_vm_args &args)
+{
+    if (bfm_read_write_ioctl(fd2, IOCTL_PREPARE_VM, &args, sizeof(prepare_vm_args)) < 0) {
+        throw std::runtime_error("ioctl failed: IOCTL_PREPARE_VM");
+    }
+}
+
 void
 ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
 {
@@ -144,6 +152,45 @@ ioctl_private::call_ioctl_destroy(domainid_t domainid) noexcept
     }
 }
 
+void
+ioctl_private::call_ioctl_wait_for_resume()
+{ throw std::runtime_error("ioctl not supported: IOCTL_WAIT_FOR_RESUME"); }
+
+// Note:
+//
+// The Windows builder does not map its memory into userspace, so shared
+// memory is never available, and callers fall back to interfaces that do not
+// need it (e.g. polling the UART with dump_uart).
+//
+
+void
+ioctl_private::call_ioctl_set_uart_ring(set_uart_ring_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("ioctl not supported: IOCTL_SET_UART_RING");
+}
+
+void
+ioctl_private::call_ioctl_register_buffer(register_buffer_args &args)
+{
+    bfignored(args);
+    throw std::runtime_error("ioctl not supported: IOCTL_REGISTER_BUFFER");
+}
+
+void *
+ioctl_private::map_shared_memory(std::size_t size) noexcept
+{
+    bfignored(size);
+    return nullptr;
+}
+
+void
+ioctl_private::unmap_shared_memory(void *ptr, std::size_t size) noexcept
+{
+    bfignored(ptr);
+    bfignored(size);
+}
+
 uint64_t
 ioctl_private::call_ioctl_vmcall(uint64_t r1, uint64_t r2, uint64_t r3, uint64_t r4)
 {
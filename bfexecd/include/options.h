@@ -0,0 +1,73 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#ifndef OPTIONS_H
+#define OPTIONS_H
+
+#ifdef _MSC_VER
+#pragma warning(push)
+#pragma warning(disable : 4267)
+#endif
+
+#include "cxxopts.hpp"
+
+#ifdef _MSC_VER
+#pragma warning(pop)
+#endif
+
+using args_type = cxxopts::ParseResult;
+
+inline bool verbose = false;
+inline cxxopts::Options options("bfexecd", "supervises many virtual machines");
+
+inline args_type
+parse_args(int argc, char *argv[])
+{
+    using namespace cxxopts;
+
+    options.add_options()
+    ("h,help", "Print this help menu")
+    ("v,verbose", "Enable verbose output")
+    ("version", "Print the version")
+    ("socket", "The control socket's path", value<std::string>(), "[path]")
+    ("timer_slack", "The vCPU threads' timer slack", value<uint64_t>(), "[nsec]")
+    ("backlog", "The console output kept per VM (default 65536)", value<uint64_t>(), "[bytes]");
+
+    auto args = options.parse(argc, argv);
+
+    if (args.count("help")) {
+        std::cout << options.help() << '\n';
+        exit(EXIT_SUCCESS);
+    }
+
+    if (args.count("version")) {
+        std::cout << "version: N/A" << '\n';
+        exit(EXIT_SUCCESS);
+    }
+
+    if (args.count("verbose")) {
+        verbose = true;
+    }
+
+    return args;
+}
+
+#endif
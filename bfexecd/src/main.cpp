@@ -0,0 +1,1071 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <bfgsl.h>
+#include <bfdebug.h>
+#include <bfstring.h>
+#include <bfaffinity.h>
+#include <bfbuilderinterface.h>
+
+#include <map>
+#include <list>
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <iostream>
+
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+
+#include <cmdl.h>
+#include <file.h>
+#include <ioctl.h>
+#include <common.h>
+#include <options.h>
+
+using namespace std::chrono;
+
+uint64_t g_backlog_size = 0x10000;
+constexpr const auto wallclock_refresh_ticks = 60;
+
+// -----------------------------------------------------------------------------
+// VMs
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Each VM that the daemon supervises gets a single thread that runs its vCPU
+// (the same loop that bfexec uses). Everything else (the control socket, the
+// consoles and the UART rings) is handled by the event loop, which is the
+// only thread that touches the list of VMs. The vCPU threads only ever touch
+// their own VM, and they tell the event loop that their VM's UART ring has
+// output (or that the vCPU has stopped) through a shared eventfd.
+//
+
+enum class vm_state {
+    running,
+    halted,
+    faulted
+};
+
+struct vm_args {
+    std::string bzimage;
+    std::string initrd;
+    std::string cmdline;
+
+    uint64_t size{};
+    uint64_t uart{};
+    uint64_t affinity{};
+    uint64_t cpu_quota{};
+    uint64_t cpu_period{100000};
+};
+
+struct vm {
+    domainid_t domainid{INVALID_DOMAINID};
+    vcpuid_t vcpuid{INVALID_VCPUID};
+    uint64_t affinity{};
+
+    std::thread thread;
+    vcpu_thread_state thread_state;
+
+    bool notified{};
+    std::atomic<vm_state> state{vm_state::running};
+
+    struct boxy_uart_ring *ring{};
+    std::string backlog;
+    std::string input;
+    std::list<int> consoles;
+};
+
+std::map<domainid_t, std::unique_ptr<vm>> g_vms;
+int g_doorbell_fd{-1};
+
+const char *
+to_string(vm_state state)
+{
+    switch (state) {
+        case vm_state::running:
+            return "running";
+
+        case vm_state::halted:
+            return "halted";
+
+        default:
+            return "faulted";
+    }
+}
+
+vm &
+get_vm(domainid_t domainid)
+{
+    auto iter = g_vms.find(domainid);
+    if (iter == g_vms.end()) {
+        throw std::runtime_error("unknown domain " + std::to_string(domainid));
+    }
+
+    return *iter->second;
+}
+
+// -----------------------------------------------------------------------------
+// Doorbell
+// -----------------------------------------------------------------------------
+
+void
+notify_event_loop(vm &v)
+{
+    // Note:
+    //
+    // The eventfd is only written once until the event loop has looked at
+    // this VM again, so that a guest that is printing does not cost its
+    // vCPU thread a write(2) on every exit.
+    //
+
+    if (__atomic_exchange_n(&v.notified, true, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
+    uint64_t one = 1;
+    if (write(g_doorbell_fd, &one, sizeof(one)) != sizeof(one)) {
+        std::cerr << "[ERROR]: failed to notify the event loop\n";
+    }
+}
+
+// -----------------------------------------------------------------------------
+// vCPU Thread
+// -----------------------------------------------------------------------------
+
+void
+uart_doorbell(vm &v)
+{
+    if (v.ring == nullptr) {
+        return;
+    }
+
+    if (__atomic_load_n(&v.ring->doorbell, __ATOMIC_ACQUIRE) != 0) {
+        notify_event_loop(v);
+    }
+}
+
+void
+vcpu_thread(vm *v)
+{
+    set_affinity(v->affinity);
+
+    auto ret = run_vcpu(v->domainid, v->vcpuid, v->thread_state, [v] {
+        uart_doorbell(*v);
+    });
+
+    v->state = ret == vcpu_exit::halted ? vm_state::halted : vm_state::faulted;
+    notify_event_loop(*v);
+}
+
+// -----------------------------------------------------------------------------
+// UART Ring
+// -----------------------------------------------------------------------------
+
+bool
+setup_uart_ring(vm &v)
+{
+    auto ptr = ctl->map_shared_memory(sizeof(struct boxy_uart_ring));
+    if (ptr == nullptr) {
+        return false;
+    }
+
+    auto ring = static_cast<struct boxy_uart_ring *>(ptr);
+
+    try {
+        set_uart_ring_args args{v.domainid, ring};
+        ctl->call_ioctl_set_uart_ring(args);
+    }
+    catch (...) {
+        ctl->unmap_shared_memory(ptr, sizeof(struct boxy_uart_ring));
+        return false;
+    }
+
+    v.ring = ring;
+    return true;
+}
+
+void
+release_uart_ring(vm &v)
+{
+    if (v.ring == nullptr) {
+        return;
+    }
+
+    // Note:
+    //
+    // Unmapping the ring is all that is needed, as the builder takes the
+    // ring back from the VMM before the ring's memory is freed.
+    //
+
+    ctl->unmap_shared_memory(v.ring, sizeof(struct boxy_uart_ring));
+    v.ring = nullptr;
+}
+
+// -----------------------------------------------------------------------------
+// Clients
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Clients talk to the daemon using a line based protocol over a Unix socket:
+//
+//   create <bzimage> <initrd> [size=<bytes>] [uart=<port>] [affinity=<core>]
+//          [cpu_quota=<usec>] [cpu_period=<usec>] [cmdline=<text...>]
+//   destroy <domainid>
+//   list
+//   console <domainid>
+//   prepare <size> [count]
+//
+// Each command is answered with "ok [...]" or "error <reason>". Once a
+// client attaches to a console, it is sent the VM's recent output, and from
+// then on, everything that it writes is given to the VM's UART. The prepare
+// command fills the builder's pool of prepared VMs, which is used by any VM
+// that is later created with the same size.
+//
+
+constexpr const auto client_max_line = 0x1000;
+
+struct client {
+    std::string input;
+    domainid_t console{INVALID_DOMAINID};
+};
+
+std::map<int, client> g_clients;
+
+void
+send_to_client(int fd, const char *data, size_t size)
+{
+    // Note:
+    //
+    // The event loop never blocks on a client. If a client is not keeping
+    // up with its console, the output that does not fit in its socket
+    // buffer is dropped (it is still in the VM's backlog).
+    //
+
+    while (size > 0) {
+        auto ret = send(fd, data, size, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (ret <= 0) {
+            return;
+        }
+
+        data += ret;
+        size -= static_cast<size_t>(ret);
+    }
+}
+
+void
+send_to_client(int fd, const std::string &str)
+{ send_to_client(fd, str.data(), str.size()); }
+
+void
+detach_console(int fd, client &c)
+{
+    if (c.console == INVALID_DOMAINID) {
+        return;
+    }
+
+    if (auto iter = g_vms.find(c.console); iter != g_vms.end()) {
+        iter->second->consoles.remove(fd);
+    }
+
+    c.console = INVALID_DOMAINID;
+}
+
+void
+close_client(int fd)
+{
+    if (auto iter = g_clients.find(fd); iter != g_clients.end()) {
+        detach_console(fd, iter->second);
+        g_clients.erase(iter);
+    }
+
+    close(fd);
+}
+
+// -----------------------------------------------------------------------------
+// Consoles
+// -----------------------------------------------------------------------------
+
+void
+drain_uart_ring(vm &v)
+{
+    auto ring = v.ring;
+
+    if (ring == nullptr) {
+        return;
+    }
+
+    // Note:
+    //
+    // The doorbell is cleared with an exchange (which is a full barrier) so
+    // that prod cannot be read before the doorbell is cleared, otherwise we
+    // could miss output written by the VMM right before it rang again.
+    //
+
+    __atomic_exchange_n(&ring->doorbell, 0, __ATOMIC_SEQ_CST);
+
+    auto prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    auto cons = ring->cons;
+
+    if (prod - cons > BOXY_UART_RING_SIZE) {
+        cons = prod - BOXY_UART_RING_SIZE;
+    }
+
+    while (cons != prod) {
+        auto index = cons & (BOXY_UART_RING_SIZE - 1);
+        auto bytes = std::min(prod - cons, BOXY_UART_RING_SIZE - index);
+
+        for (auto fd : v.consoles) {
+            send_to_client(fd, &ring->data[index], bytes);
+        }
+
+        v.backlog.append(&ring->data[index], bytes);
+        cons += bytes;
+    }
+
+    __atomic_store_n(&ring->cons, cons, __ATOMIC_RELEASE);
+
+    if (v.backlog.size() > g_backlog_size) {
+        v.backlog.erase(0, v.backlog.size() - g_backlog_size);
+    }
+}
+
+void
+flush_input(vm &v)
+{
+    // Note:
+    //
+    // Input that does not fit in the UART's receive buffer (or that cannot
+    // be given to the VMM while the host is suspending) is kept, and given
+    // to the guest the next time the event loop looks at this VM.
+    //
+
+    while (!v.input.empty()) {
+        auto ret = hypercall_domain_op__write_uart(
+            v.domainid, v.input.data(), v.input.size());
+
+        if (ret == SUSPEND || ret == 0) {
+            return;
+        }
+
+        if (ret == FAILURE) {
+            std::cerr << "[ERROR]: write uart failure!!!\n";
+            v.input.clear();
+            return;
+        }
+
+        v.input.erase(0, ret);
+        kick_vcpu(v.thread_state);
+    }
+}
+
+void
+write_input(vm &v, const char *data, size_t size)
+{
+    if (v.input.size() + size > g_backlog_size) {
+        return;
+    }
+
+    v.input.append(data, size);
+    flush_input(v);
+}
+
+void
+process_vms()
+{
+    for (const auto &[domainid, v] : g_vms) {
+        bfignored(domainid);
+
+        __atomic_store_n(&v->notified, false, __ATOMIC_RELEASE);
+
+        drain_uart_ring(*v);
+        flush_input(*v);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Create / Destroy
+// -----------------------------------------------------------------------------
+
+static domainid_t
+create_vm_from_bzimage(const vm_args &args)
+{
+    create_vm_from_bzimage_args ioctl_args {};
+
+    bfn::cmdl cmdl;
+    bfn::file bzimage(args.bzimage);
+    bfn::file initrd(args.initrd);
+
+    uint64_t size = bzimage.size() * 2;
+    if (args.size != 0) {
+        size = args.size;
+    }
+
+    if (size < 0x2000000) {
+        size = 0x2000000;
+    }
+
+    if (args.uart != 0) {
+        cmdl.add(
+            "console=uart,io," + bfn::to_string(args.uart, 16) + ",115200n8"
+        );
+    }
+
+    if (!args.cmdline.empty()) {
+        cmdl.add(args.cmdline);
+    }
+
+    ioctl_args.bzimage = bzimage.data();
+    ioctl_args.bzimage_size = bzimage.size();
+    ioctl_args.initrd = initrd.data();
+    ioctl_args.initrd_size = initrd.size();
+    ioctl_args.cmdl = cmdl.data();
+    ioctl_args.cmdl_size = cmdl.size();
+    ioctl_args.uart = args.uart;
+    ioctl_args.size = size;
+
+    ctl->call_ioctl_create_vm_from_bzimage(ioctl_args);
+    return ioctl_args.domainid;
+}
+
+static void
+set_cpu_quota(domainid_t domainid, const vm_args &args)
+{
+    if (args.cpu_quota == 0) {
+        return;
+    }
+
+    if (args.cpu_quota > args.cpu_period) {
+        throw std::runtime_error("cpu_quota must be in (0, cpu_period]");
+    }
+
+    auto ret = hypercall_domain_op__set_cpu_quota(
+        domainid,
+        (args.cpu_quota * g_tsc_freq_khz) / 1000,
+        (args.cpu_period * g_tsc_freq_khz) / 1000
+    );
+
+    if (ret != SUCCESS) {
+        throw std::runtime_error("set_cpu_quota failed");
+    }
+}
+
+domainid_t
+start_vm(const vm_args &args)
+{
+    // Note:
+    //
+    // We do not support VMCS migration, so the vCPU has to be created on the
+    // same core that it is run on. The event loop's own affinity does not
+    // matter, so it is simply moved to the VM's core while the VM is created.
+    //
+
+    set_affinity(args.affinity);
+
+    auto v = std::make_unique<vm>();
+    v->affinity = args.affinity;
+    v->domainid = create_vm_from_bzimage(args);
+
+    try {
+        set_cpu_quota(v->domainid, args);
+
+        v->vcpuid = hypercall_vcpu_op__create_vcpu(v->domainid);
+        if (v->vcpuid == INVALID_VCPUID) {
+            throw std::runtime_error("__vcpu_op__create_vcpu failed");
+        }
+    }
+    catch (...) {
+        ctl->call_ioctl_destroy(v->domainid);
+        throw;
+    }
+
+    if (args.uart != 0 && !setup_uart_ring(*v)) {
+        std::cerr << "[WARNING]: failed to set up the uart ring for domain ";
+        std::cerr << v->domainid << '\n';
+    }
+
+    v->thread = std::thread(vcpu_thread, v.get());
+
+    auto domainid = v->domainid;
+    g_vms[domainid] = std::move(v);
+
+    return domainid;
+}
+
+void
+stop_vm(vm &v)
+{
+    if (v.state == vm_state::running) {
+        hypercall_vcpu_op__kill_vcpu(v.vcpuid);
+    }
+
+    kick_vcpu(v.thread_state);
+    v.thread.join();
+
+    drain_uart_ring(v);
+    release_uart_ring(v);
+
+    if (hypercall_vcpu_op__destroy_vcpu(v.vcpuid) != SUCCESS) {
+        std::cerr << "__vcpu_op__destroy_vcpu failed\n";
+    }
+
+    ctl->call_ioctl_destroy(v.domainid);
+
+    for (auto fd : v.consoles) {
+        send_to_client(fd, "\nerror domain destroyed\n");
+
+        if (auto iter = g_clients.find(fd); iter != g_clients.end()) {
+            iter->second.console = INVALID_DOMAINID;
+        }
+    }
+}
+
+void
+destroy_vm(domainid_t domainid)
+{
+    stop_vm(get_vm(domainid));
+    g_vms.erase(domainid);
+}
+
+void
+destroy_all_vms()
+{
+    for (const auto &[domainid, v] : g_vms) {
+        bfignored(domainid);
+        stop_vm(*v);
+    }
+
+    g_vms.clear();
+}
+
+// -----------------------------------------------------------------------------
+// Commands
+// -----------------------------------------------------------------------------
+
+uint64_t
+to_u64(const std::string &str)
+{ return std::stoull(str, nullptr, 0); }
+
+domainid_t
+parse_domainid(std::istringstream &iss)
+{
+    std::string str;
+    if (!(iss >> str)) {
+        throw std::runtime_error("missing domain id");
+    }
+
+    return to_u64(str);
+}
+
+std::string
+command_create(std::istringstream &iss)
+{
+    vm_args args;
+
+    if (!(iss >> args.bzimage >> args.initrd)) {
+        throw std::runtime_error("must specify a bzimage and an initrd");
+    }
+
+    std::string opt;
+    while (iss >> opt) {
+        auto pos = opt.find('=');
+        if (pos == std::string::npos) {
+            throw std::runtime_error("invalid option: " + opt);
+        }
+
+        auto key = opt.substr(0, pos);
+        auto val = opt.substr(pos + 1);
+
+        if (key == "cmdline") {
+            std::string rest;
+            std::getline(iss, rest);
+            args.cmdline = val + rest;
+            break;
+        }
+
+        if (key == "size") {
+            args.size = to_u64(val);
+        }
+        else if (key == "uart") {
+            args.uart = to_u64(val);
+        }
+        else if (key == "affinity") {
+            args.affinity = to_u64(val);
+        }
+        else if (key == "cpu_quota") {
+            args.cpu_quota = to_u64(val);
+        }
+        else if (key == "cpu_period") {
+            args.cpu_period = to_u64(val);
+        }
+        else {
+            throw std::runtime_error("invalid option: " + key);
+        }
+    }
+
+    auto domainid = start_vm(args);
+
+    if (verbose) {
+        std::cout << "created domain " << domainid << ": " << args.bzimage << '\n';
+    }
+
+    return "ok " + std::to_string(domainid) + '\n';
+}
+
+std::string
+command_destroy(std::istringstream &iss)
+{
+    auto domainid = parse_domainid(iss);
+    destroy_vm(domainid);
+
+    if (verbose) {
+        std::cout << "destroyed domain " << domainid << '\n';
+    }
+
+    return "ok\n";
+}
+
+std::string
+command_list()
+{
+    std::string str;
+
+    for (const auto &[domainid, v] : g_vms) {
+        str += std::to_string(domainid) + ' ';
+        str += std::to_string(v->vcpuid) + ' ';
+        str += to_string(v->state);
+        str += '\n';
+    }
+
+    return str + "ok\n";
+}
+
+std::string
+command_console(int fd, client &c, std::istringstream &iss)
+{
+    auto domainid = parse_domainid(iss);
+    auto &v = get_vm(domainid);
+
+    if (v.ring == nullptr) {
+        throw std::runtime_error("domain does not have a uart");
+    }
+
+    detach_console(fd, c);
+
+    c.console = domainid;
+    v.consoles.push_back(fd);
+
+    return "ok\n" + v.backlog;
+}
+
+std::string
+command_prepare(std::istringstream &iss)
+{
+    std::string size;
+    std::string count = "1";
+
+    if (!(iss >> size)) {
+        throw std::runtime_error("must specify a size");
+    }
+
+    iss >> count;
+
+    std::string str = "ok";
+    for (uint64_t i = 0; i < to_u64(count); i++) {
+        prepare_vm_args ioctl_args {};
+
+        ioctl_args.size = to_u64(size);
+        ctl->call_ioctl_prepare_vm(ioctl_args);
+
+        str += ' ' + std::to_string(ioctl_args.domainid);
+    }
+
+    return str + '\n';
+}
+
+std::string
+process_command(int fd, client &c, const std::string &line)
+{
+    std::istringstream iss(line);
+    std::string cmd;
+
+    try {
+        if (!(iss >> cmd)) {
+            return {};
+        }
+
+        if (cmd == "create") {
+            return command_create(iss);
+        }
+
+        if (cmd == "destroy") {
+            return command_destroy(iss);
+        }
+
+        if (cmd == "list") {
+            return command_list();
+        }
+
+        if (cmd == "console") {
+            return command_console(fd, c, iss);
+        }
+
+        if (cmd == "prepare") {
+            return command_prepare(iss);
+        }
+
+        throw std::runtime_error("unknown command: " + cmd);
+    }
+    catch (const std::exception &e) {
+        return std::string("error ") + e.what() + '\n';
+    }
+}
+
+void
+process_client(int fd)
+{
+    std::array<char, UART_MAX_BUFFER> buffer{};
+
+    auto bytes = recv(fd, buffer.data(), buffer.size(), MSG_DONTWAIT);
+    if (bytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+
+    if (bytes <= 0) {
+        return close_client(fd);
+    }
+
+    auto &c = g_clients[fd];
+    c.input.append(buffer.data(), static_cast<size_t>(bytes));
+
+    while (c.console == INVALID_DOMAINID) {
+        auto pos = c.input.find('\n');
+        if (pos == std::string::npos) {
+            break;
+        }
+
+        auto line = c.input.substr(0, pos);
+        c.input.erase(0, pos + 1);
+
+        send_to_client(fd, process_command(fd, c, line));
+    }
+
+    if (c.console != INVALID_DOMAINID) {
+        write_input(get_vm(c.console), c.input.data(), c.input.size());
+        c.input.clear();
+    }
+
+    if (c.input.size() > client_max_line) {
+        send_to_client(fd, "error line too long\n");
+        return close_client(fd);
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Event Loop
+// -----------------------------------------------------------------------------
+
+int
+open_socket(const std::string &path)
+{
+    struct sockaddr_un addr {};
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+        throw std::runtime_error("socket path is too long");
+    }
+
+    auto fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        throw std::runtime_error("failed to create the control socket");
+    }
+
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, path.size());
+
+    unlink(path.c_str());
+
+    if (bind(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) != 0 ||
+        chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+        listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        throw std::runtime_error("failed to listen on " + path);
+    }
+
+    return fd;
+}
+
+void
+epoll_add(int epfd, int fd)
+{
+    struct epoll_event event {};
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        throw std::runtime_error("epoll_ctl failed");
+    }
+}
+
+void
+accept_client(int epfd, int sock)
+{
+    auto fd = accept4(sock, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+
+    try {
+        epoll_add(epfd, fd);
+        g_clients[fd] = {};
+    }
+    catch (...) {
+        close(fd);
+    }
+}
+
+void
+process_timer(int fd)
+{
+    // Note:
+    //
+    // The timer is a backstop for a guest that prints without ever returning
+    // to its vCPU thread (in which case the doorbell is never seen), and it
+    // is also used to periodically refresh the host wall clock so that it
+    // tracks any adjustments made to the host's clock (e.g. NTP).
+    //
+
+    static uint64_t ticks = 0;
+
+    uint64_t expirations = 0;
+    if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+
+    process_vms();
+
+    ticks += expirations;
+    if (ticks >= wallclock_refresh_ticks) {
+        ticks = 0;
+
+        if (!set_wallclock()) {
+            std::cerr << "[WARNING]: failed to refresh the host wallclock\n";
+        }
+    }
+}
+
+void
+process_doorbell(int fd)
+{
+    uint64_t count = 0;
+    if (read(fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+
+    process_vms();
+}
+
+void
+event_loop(int sock, int sigfd)
+{
+    auto epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0) {
+        throw std::runtime_error("epoll_create1 failed");
+    }
+
+    auto timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timerfd < 0) {
+        close(epfd);
+        throw std::runtime_error("timerfd_create failed");
+    }
+
+    auto ___ = gsl::finally([&] {
+        close(timerfd);
+        close(epfd);
+    });
+
+    struct itimerspec its {};
+    its.it_value.tv_sec = 1;
+    its.it_interval.tv_sec = 1;
+
+    if (timerfd_settime(timerfd, 0, &its, nullptr) != 0) {
+        throw std::runtime_error("timerfd_settime failed");
+    }
+
+    epoll_add(epfd, sock);
+    epoll_add(epfd, sigfd);
+    epoll_add(epfd, timerfd);
+    epoll_add(epfd, g_doorbell_fd);
+
+    std::array<struct epoll_event, 64> events{};
+
+    while (true) {
+        auto num = epoll_wait(epfd, events.data(), events.size(), -1);
+        if (num < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            throw std::runtime_error("epoll_wait failed");
+        }
+
+        for (auto i = 0; i < num; i++) {
+            auto fd = events.at(static_cast<size_t>(i)).data.fd;
+
+            if (fd == sigfd) {
+                return;
+            }
+
+            if (fd == sock) {
+                accept_client(epfd, sock);
+            }
+            else if (fd == timerfd) {
+                process_timer(timerfd);
+            }
+            else if (fd == g_doorbell_fd) {
+                process_doorbell(g_doorbell_fd);
+            }
+            else if (g_clients.count(fd) != 0) {
+                process_client(fd);
+            }
+        }
+    }
+}
+
+// -----------------------------------------------------------------------------
+// Main Functions
+// -----------------------------------------------------------------------------
+
+static int
+protected_main(const args_type &args)
+{
+    std::string path = "/var/run/bfexecd.sock";
+    if (args.count("socket")) {
+        path = args["socket"].as<std::string>();
+    }
+
+    if (args.count("timer_slack")) {
+        g_timer_slack = args["timer_slack"].as<uint64_t>();
+    }
+
+    if (args.count("backlog")) {
+        g_backlog_size = args["backlog"].as<uint64_t>();
+    }
+
+    // Note:
+    //
+    // The kill signals are blocked (and inherited as blocked by the vCPU
+    // threads) and are instead read by the event loop, so that the daemon
+    // can stop all of its VMs before it exits.
+    //
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGQUIT);
+
+    if (pthread_sigmask(SIG_BLOCK, &mask, nullptr) != 0) {
+        throw std::runtime_error("failed to block the kill signals");
+    }
+
+    auto sigfd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigfd < 0) {
+        throw std::runtime_error("signalfd failed");
+    }
+
+    g_doorbell_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (g_doorbell_fd < 0) {
+        close(sigfd);
+        throw std::runtime_error("eventfd failed");
+    }
+
+    auto sock = open_socket(path);
+
+    auto ___ = gsl::finally([&] {
+        destroy_all_vms();
+
+        for (const auto &[fd, c] : g_clients) {
+            bfignored(c);
+            close(fd);
+        }
+
+        g_clients.clear();
+
+        close(sock);
+        unlink(path.c_str());
+
+        close(g_doorbell_fd);
+        close(sigfd);
+    });
+
+    if (!set_wallclock()) {
+        throw std::runtime_error("set_wallclock failed");
+    }
+
+    if (verbose) {
+        std::cout << "listening on " << path << '\n';
+    }
+
+    event_loop(sock, sigfd);
+    return EXIT_SUCCESS;
+}
+
+int
+main(int argc, char *argv[])
+{
+    setup_kick_signal_handler();
+
+    try {
+        init_tsc();
+        args_type args = parse_args(argc, argv);
+        return protected_main(args);
+    }
+    catch (const cxxopts::OptionException &e) {
+        std::cerr << "invalid arguments: " << e.what() << '\n';
+    }
+    catch (const std::exception &e) {
+        std::cerr << "Caught unhandled exception:" << '\n';
+        std::cerr << "    - what(): " << e.what() << '\n';
+    }
+    catch (...) {
+        std::cerr << "Caught unknown exception" << '\n';
+    }
+
+    return EXIT_FAILURE;
+}
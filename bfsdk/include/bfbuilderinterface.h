@@ -48,6 +48,10 @@ extern "C" {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE_CMD 0x901
 #define IOCTL_DESTROY_CMD 0x902
+#define IOCTL_WAIT_FOR_RESUME_CMD 0x903
+#define IOCTL_PREPARE_VM_CMD 0x904
+#define IOCTL_SET_UART_RING_CMD 0x905
+#define IOCTL_REGISTER_BUFFER_CMD 0x906
 
 /**
  * @struct create_vm_from_bzimage_args
@@ -96,6 +100,67 @@ struct create_vm_from_bzimage_args {
     uint64_t domainid;
 };
 
+/**
+ * @struct prepare_vm_args
+ *
+ * This structure is used to prepare a VM ahead of time. A prepared VM has
+ * its RAM, boot structures and initial register state in place, and is used
+ * by the next create_vm_from_bzimage request that asks for the same amount
+ * of RAM, so that only the kernel, initrd and command line have to be loaded
+ * when the VM is needed.
+ *
+ * @var prepare_vm_args::size
+ *     the amount of RAM to give to the domain
+ * @var prepare_vm_args::domainid
+ *     (out) the domain ID of the VM that was prepared
+ */
+struct prepare_vm_args {
+    uint64_t size;
+    uint64_t domainid;
+};
+
+/**
+ * @struct set_uart_ring_args
+ *
+ * This structure is used to give a domain's UART ring to the VMM. The ring
+ * must be memory that was mapped from the builder device (i.e. using mmap),
+ * as the builder's memory is physically contiguous and is never moved by the
+ * kernel, which is not true of ordinary (even locked) memory. The builder
+ * takes the ring back from the VMM once the ring is unmapped. This is
+ * currently only supported on Linux.
+ *
+ * @var set_uart_ring_args::domainid
+ *     the domain whose UART output should be written to the ring
+ * @var set_uart_ring_args::ring
+ *     the ring, which must be the start of a mapping of the builder device
+ */
+struct set_uart_ring_args {
+    uint64_t domainid;
+    struct boxy_uart_ring *ring;
+};
+
+/**
+ * @struct register_buffer_args
+ *
+ * This structure is used to register a buffer with a domain, so that
+ * hypercalls that support registered buffers (e.g. dump_uart_buffer) can
+ * refer to the buffer by handle. Like a UART ring, the buffer must be the
+ * whole of a mapping of the builder device, and the builder unregisters the
+ * buffer once it is unmapped. This is currently only supported on Linux.
+ *
+ * @var register_buffer_args::domainid
+ *     the domain to register the buffer with
+ * @var register_buffer_args::buffer
+ *     the buffer, which must be the start of a mapping of the builder device
+ * @var register_buffer_args::handle
+ *     (out) the buffer's handle
+ */
+struct register_buffer_args {
+    uint64_t domainid;
+    void *buffer;
+    uint64_t handle;
+};
+
 /* -------------------------------------------------------------------------- */
 /* Linux Interfaces                                                           */
 /* -------------------------------------------------------------------------- */
@@ -104,6 +169,10 @@ struct create_vm_from_bzimage_args {
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE _IOWR(BUILDER_MAJOR, IOCTL_CREATE_VM_FROM_BZIMAGE_CMD, struct create_vm_from_bzimage_args *)
 #define IOCTL_DESTROY _IOW(BUILDER_MAJOR, IOCTL_DESTROY_CMD, domainid_t *)
+#define IOCTL_WAIT_FOR_RESUME _IO(BUILDER_MAJOR, IOCTL_WAIT_FOR_RESUME_CMD)
+#define IOCTL_PREPARE_VM _IOWR(BUILDER_MAJOR, IOCTL_PREPARE_VM_CMD, struct prepare_vm_args *)
+#define IOCTL_SET_UART_RING _IOW(BUILDER_MAJOR, IOCTL_SET_UART_RING_CMD, struct set_uart_ring_args *)
+#define IOCTL_REGISTER_BUFFER _IOWR(BUILDER_MAJOR, IOCTL_REGISTER_BUFFER_CMD, struct register_buffer_args *)
 
 #endif
 
@@ -120,6 +189,7 @@ DEFINE_GUID(GUID_DEVINTERFACE_builder,
 
 #define IOCTL_CREATE_VM_FROM_BZIMAGE CTL_CODE(BUILDER_DEVICETYPE, IOCTL_CREATE_VM_FROM_BZIMAGE_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
 #define IOCTL_DESTROY CTL_CODE(BUILDER_DEVICETYPE, IOCTL_DESTROY_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
+#define IOCTL_PREPARE_VM CTL_CODE(BUILDER_DEVICETYPE, IOCTL_PREPARE_VM_CMD, METHOD_IN_DIRECT, FILE_READ_DATA | FILE_WRITE_DATA)
 
 #endif
 
@@ -70,6 +70,7 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define hypercall_enum_domain_op 0x02
 #define hypercall_enum_vcpu_op 0x03
 #define hypercall_enum_uart_op 0x04
+#define hypercall_enum_multicall_op 0x05
 #define hypercall_enum_virq_op 0x10
 #define hypercall_enum_vclock_op 0x11
 
@@ -88,6 +89,12 @@ uint64_t _vmcall4(void *r1, void *r2, void *r3, void *r4) NOEXCEPT;
 #define run_op_ret_op(a) ((0x000000000000000FULL & a) >> 0)
 #define run_op_ret_arg(a) ((0xFFFFFFFFFFFFFFF0ULL & a) >> 4)
 
+// Note:
+//
+// For hypercall_enum_run_op__yield, run_op_ret_arg() is the absolute TSC
+// value that the vCPU should sleep until (not a relative amount of time).
+//
+
 static inline vcpuid_t
 hypercall_run_op(vcpuid_t vcpuid, uint64_t arg1, uint64_t arg2)
 {
@@ -96,6 +103,93 @@ hypercall_run_op(vcpuid_t vcpuid, uint64_t arg1, uint64_t arg2)
     );
 }
 
+// -----------------------------------------------------------------------------
+// Multicall Operations
+// -----------------------------------------------------------------------------
+
+/*
+ * Multicall
+ *
+ * Executes a batch of hypercalls, in order, in a single VM exit. Each entry
+ * holds the registers of one hypercall (i.e. the same rax-rdx that would be
+ * given to _vmcall), and once the hypercall is executed, its return value
+ * (i.e. rax) is written to the entry's ret. Only hypercalls that return to
+ * the caller, and that only return rax, can be batched, so a run_op, a nested
+ * multicall, a hypercall that might hand control back to dom0 (e.g. vclock
+ * reset_host_wallclock) or a getter that returns more than rax (e.g. vclock
+ * get_guest_wallclock) has its ret set to FAILURE, as does an entry that is
+ * unknown, and the remaining entries are still executed. Returns SUCCESS
+ * once all of the entries have been executed, or FAILURE if the entries
+ * could not be read.
+ */
+
+#define HYPERCALL_MULTICALL_MAX_ENTRIES 64
+
+#define hypercall_enum_multicall_op__multicall 0xBF05000000000000
+#define hypercall_enum_multicall_op__set_multicall_page 0xBF05000000000100
+#define hypercall_enum_multicall_op__multicall_page 0xBF05000000000101
+
+#pragma pack(push, 8)
+
+struct hypercall_multicall_entry {
+    uint64_t rax;
+    uint64_t rbx;
+    uint64_t rcx;
+    uint64_t rdx;
+    uint64_t ret;
+};
+
+#pragma pack(pop)
+
+static inline void
+hypercall_multicall_entry__set(
+    struct hypercall_multicall_entry *entry,
+    uint64_t rax, uint64_t rbx, uint64_t rcx, uint64_t rdx)
+{
+    entry->rax = rax;
+    entry->rbx = rbx;
+    entry->rcx = rcx;
+    entry->rdx = rdx;
+    entry->ret = FAILURE;
+}
+
+static inline status_t
+hypercall_multicall_op(struct hypercall_multicall_entry *entries, uint64_t num)
+{
+    return _vmcall(
+        hypercall_enum_multicall_op__multicall, bfrcast(uint64_t, entries), num, 0
+    );
+}
+
+/*
+ * Multicall Page
+ *
+ * A guest can register a multicall page (one per vCPU) so that the VMM
+ * maps it once, instead of translating the entries' address on every
+ * multicall. The guest fills in the first num entries of the page and then
+ * executes them with hypercall_multicall_op__multicall_page, which is meant
+ * for paths that issue several hypercalls back to back (e.g. a
+ * vclock set_next_event followed by a virq get_next_virq). At most
+ * HYPERCALL_MULTICALL_MAX_ENTRIES entries of the page are used. The gpa
+ * must be page aligned, and a gpa of 0 unregisters the page.
+ */
+
+static inline status_t
+hypercall_multicall_op__set_multicall_page(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_multicall_op__set_multicall_page, gpa, 0, 0
+    );
+}
+
+static inline status_t
+hypercall_multicall_op__multicall_page(uint64_t num)
+{
+    return _vmcall(
+        hypercall_enum_multicall_op__multicall_page, num, 0, 0
+    );
+}
+
 // -----------------------------------------------------------------------------
 // Uart Operations
 // -----------------------------------------------------------------------------
@@ -128,6 +222,26 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
     );
 }
 
+/*
+ * Write
+ *
+ * Writes a buffer to an emulated UART in a single VM exit (instead of one
+ * I/O instruction per byte), which is meant to be used by a guest's console
+ * driver (e.g. an hvc backend's put_chars). The buffer is a guest virtual
+ * address. Returns the number of bytes written, which can be less than len
+ * (at most UART_MAX_BUFFER bytes are written per call), or FAILURE.
+ */
+
+#define hypercall_enum_uart_op__write 0xBF04000000000100
+
+static inline uint64_t
+hypercall_uart_op__write(uint16_t port, const char *buf, uint64_t len)
+{
+    return _vmcall(
+        hypercall_enum_uart_op__write, port, bfrcast(uint64_t, buf), len
+    );
+}
+
 // -----------------------------------------------------------------------------
 // Domain Operations
 // -----------------------------------------------------------------------------
@@ -138,6 +252,14 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 #define hypercall_enum_domain_op__set_uart 0xBF02000000000200
 #define hypercall_enum_domain_op__set_pt_uart 0xBF02000000000201
 #define hypercall_enum_domain_op__dump_uart 0xBF02000000000202
+#define hypercall_enum_domain_op__set_uart_ring 0xBF02000000000203
+#define hypercall_enum_domain_op__write_uart 0xBF02000000000204
+#define hypercall_enum_domain_op__dump_uart_buffer 0xBF02000000000205
+
+#define hypercall_enum_domain_op__set_cpu_quota 0xBF02000000000400
+
+#define hypercall_enum_domain_op__register_buffer 0xBF02000000000500
+#define hypercall_enum_domain_op__unregister_buffer 0xBF02000000000501
 
 #define hypercall_enum_domain_op__share_page_r 0xBF02000000000300
 #define hypercall_enum_domain_op__share_page_rw 0xBF02000000000301
@@ -266,6 +388,56 @@ hypercall_uart_ndec_op(uint16_t port, uint64_t val)
 
 #define UART_MAX_BUFFER 0x4000
 
+/*
+ * UART Ring
+ *
+ * Instead of polling the UART with dump_uart, dom0 can give the VMM a ring
+ * that the VMM writes the UART's output into. The ring is given to the VMM
+ * by guest physical address, and it must be page aligned and physically
+ * contiguous memory that dom0 never moves, which is why the ring is
+ * allocated (and handed to the VMM) by the builder driver, and not by
+ * userspace (see IOCTL_SET_UART_RING). A gpa of 0 releases the ring.
+ * The VMM is the only producer (it owns prod) and dom0 is the only consumer
+ * (it owns cons), so no locks are needed. The VMM sets the doorbell each
+ * time it writes to the ring, which dom0 clears before draining it. Bytes
+ * that do not fit are counted in dropped.
+ */
+
+#define BOXY_UART_RING_SIZE 0x10000
+
+#pragma pack(push, 8)
+
+struct boxy_uart_ring {
+    uint64_t prod;
+    uint64_t cons;
+    uint64_t doorbell;
+    uint64_t dropped;
+    char data[BOXY_UART_RING_SIZE];
+};
+
+#pragma pack(pop)
+
+/*
+ * Registered Buffers
+ *
+ * Hypercalls that move data (like dump_uart) have to translate and map the
+ * caller's buffer each time they are made. Instead, dom0 can register a
+ * buffer with a domain once. The VMM maps the buffer when it is registered
+ * and keeps the mapping until the buffer is unregistered or the domain is
+ * destroyed, and hypercalls that support registered buffers are given the
+ * buffer's handle instead of its address. Like the UART ring, the buffer is
+ * given to the VMM by guest physical address, and it must be page aligned
+ * and physically contiguous memory that dom0 never moves, so buffers are
+ * registered (and unregistered) by the builder driver, and not by userspace
+ * (see IOCTL_REGISTER_BUFFER). Unregistering a buffer of a domain that no
+ * longer exists succeeds. Note that dump_uart_buffer needs a buffer of at
+ * least UART_MAX_BUFFER bytes, and returns FAILURE if it is not given one.
+ */
+
+#define INVALID_BUFFER 0xFFFFFFFFFFFFFFFF
+#define BOXY_MAX_BUFFERS 64
+#define BOXY_MAX_BUFFER_SIZE 0x100000
+
 static inline domainid_t
 hypercall_domain_op__create_domain(void)
 {
@@ -327,6 +499,81 @@ hypercall_domain_op__dump_uart(domainid_t domainid, char *buffer)
     );
 }
 
+static inline status_t
+hypercall_domain_op__set_uart_ring(domainid_t domainid, uint64_t gpa)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_uart_ring,
+        domainid,
+        gpa,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline uint64_t
+hypercall_domain_op__write_uart(
+    domainid_t domainid, const char *buffer, uint64_t size)
+{
+    return _vmcall(
+        hypercall_enum_domain_op__write_uart,
+        domainid,
+        bfrcast(uint64_t, buffer),
+        size
+    );
+}
+
+static inline uint64_t
+hypercall_domain_op__dump_uart_buffer(domainid_t domainid, uint64_t handle)
+{
+    return _vmcall(
+        hypercall_enum_domain_op__dump_uart_buffer,
+        domainid,
+        handle,
+        0
+    );
+}
+
+static inline status_t
+hypercall_domain_op__set_cpu_quota(
+    domainid_t foreign_domainid, uint64_t quota_tsc, uint64_t period_tsc)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__set_cpu_quota,
+        foreign_domainid,
+        quota_tsc,
+        period_tsc
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
+static inline uint64_t
+hypercall_domain_op__register_buffer(
+    domainid_t domainid, uint64_t gpa, uint64_t size)
+{
+    return _vmcall(
+        hypercall_enum_domain_op__register_buffer,
+        domainid,
+        gpa,
+        size
+    );
+}
+
+static inline status_t
+hypercall_domain_op__unregister_buffer(domainid_t domainid, uint64_t handle)
+{
+    status_t ret = _vmcall(
+        hypercall_enum_domain_op__unregister_buffer,
+        domainid,
+        handle,
+        0
+    );
+
+    return ret == 0 ? SUCCESS : FAILURE;
+}
+
 static inline status_t
 hypercall_domain_op__share_page_r(
     domainid_t foreign_domainid, uint64_t gpa, uint64_t foreign_gpa)
@@ -562,6 +809,31 @@ hypercall_domain_op__set_reg(ldtr_access_rights)
 #define hypercall_enum_vcpu_op__create_vcpu 0xBF03000000000100
 #define hypercall_enum_vcpu_op__kill_vcpu 0xBF03000000000101
 #define hypercall_enum_vcpu_op__destroy_vcpu 0xBF03000000000102
+#define hypercall_enum_vcpu_op__get_runstate 0xBF03000000000103
+
+/*
+ * Run State
+ *
+ * Each guest vCPU is always in one of the following states, and the amount
+ * of time (in TSC ticks) that the vCPU has spent in each state is recorded.
+ * A vCPU is running while it is executing, runnable while it is waiting to
+ * be executed again after it was preempted (i.e. the host needed the CPU)
+ * and blocked while it has nothing to do (i.e. it yielded or halted).
+ */
+
+#define BOXY_RUNSTATE_RUNNING 0
+#define BOXY_RUNSTATE_RUNNABLE 1
+#define BOXY_RUNSTATE_BLOCKED 2
+
+#pragma pack(push, 8)
+
+struct boxy_runstate_info {
+    uint64_t state;
+    uint64_t state_entry_time;
+    uint64_t time[3];
+};
+
+#pragma pack(pop)
 
 static inline vcpuid_t
 hypercall_vcpu_op__create_vcpu(domainid_t domainid)
@@ -596,14 +868,65 @@ hypercall_vcpu_op__destroy_vcpu(vcpuid_t vcpuid)
     );
 }
 
+static inline status_t
+hypercall_vcpu_op__get_runstate(
+    vcpuid_t vcpuid, struct boxy_runstate_info *info)
+{
+    return _vmcall(
+        hypercall_enum_vcpu_op__get_runstate,
+        vcpuid,
+        bfrcast(uint64_t, info),
+        0
+    );
+}
+
 /* -------------------------------------------------------------------------- */
 /* Virtual IRQs                                                               */
 /* -------------------------------------------------------------------------- */
 
 #define boxy_virq__vclock_event_handler 0xBF00000000000201
+#define boxy_virq__uart_event_handler 0xBF00000000000202
 
 #define hypercall_enum_virq_op__set_hypervisor_callback_vector 0xBF10000000000100
 #define hypercall_enum_virq_op__get_next_virq 0xBF10000000000101
+#define hypercall_enum_virq_op__set_virq_page 0xBF10000000000102
+
+/*
+ * vIRQ Page
+ *
+ * Once a guest registers a vIRQ page (one per vCPU), vIRQs are no longer
+ * queued in the hypervisor. Instead, the hypervisor atomically sets the
+ * vIRQ's bit in the pending bitmap, and if the vIRQ is not masked, raises
+ * the hypervisor callback vector. The callback vector is only raised when
+ * upcall_pending goes from 0 to 1, so to re-arm the callback, the guest
+ * clears upcall_pending and then drains the pending bitmap (see
+ * boxy_virq_page__next_virq), all without a single VM exit.
+ *
+ * A vIRQ's bit is the low 8 bits of the vIRQ (i.e. boxy_virq__index), and
+ * the page must be page aligned.
+ */
+
+#define BOXY_VIRQ_MAX 256
+#define boxy_virq__index(a) ((a) & 0xFFULL)
+#define boxy_virq__vector(a) (0xBF00000000000200ULL | (a))
+
+/*
+ * Note:
+ *
+ * Shared pages are accessed atomically, so they use natural alignment
+ * instead of the packing used by the rest of this header. The layout is
+ * the same either way.
+ */
+
+#pragma pack(push, 8)
+
+struct boxy_virq_page {
+    uint64_t pending[BOXY_VIRQ_MAX / 64];
+    uint64_t mask[BOXY_VIRQ_MAX / 64];
+    uint64_t upcall_pending;
+};
+
+#pragma pack(pop)
 
 static inline uint64_t
 hypercall_virq_op__set_hypervisor_callback_vector(uint64_t vector)
@@ -619,6 +942,38 @@ hypercall_virq_op__get_next_virq(void)
         hypercall_enum_virq_op__get_next_virq, 0, 0, 0);
 }
 
+static inline status_t
+hypercall_virq_op__set_virq_page(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_virq_op__set_virq_page, gpa, 0, 0);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+
+static inline uint64_t
+boxy_virq_page__next_virq(struct boxy_virq_page *page)
+{
+    uint64_t i;
+
+    for (i = 0; i < BOXY_VIRQ_MAX / 64; i++) {
+        uint64_t bits =
+            __atomic_load_n(&page->pending[i], __ATOMIC_ACQUIRE) &
+            ~__atomic_load_n(&page->mask[i], __ATOMIC_RELAXED);
+
+        if (bits != 0) {
+            uint64_t bit = bfscast(uint64_t, __builtin_ctzll(bits));
+            __atomic_fetch_and(&page->pending[i], ~(1ULL << bit), __ATOMIC_ACQ_REL);
+
+            return boxy_virq__vector((i * 64) + bit);
+        }
+    }
+
+    return FAILURE;
+}
+
+#endif
+
 /* -------------------------------------------------------------------------- */
 /* Virtual Clock                                                              */
 /* -------------------------------------------------------------------------- */
@@ -626,11 +981,90 @@ hypercall_virq_op__get_next_virq(void)
 #define hypercall_enum_vclock_op__get_tsc_freq_khz 0xBF11000000000100
 #define hypercall_enum_vclock_op__set_next_event 0xBF11000000000102
 #define hypercall_enum_vclock_op__reset_host_wallclock 0xBF11000000000103
-#define hypercall_enum_vclock_op__set_host_wallclock_rtc 0xBF11000000000104
-#define hypercall_enum_vclock_op__set_host_wallclock_tsc 0xBF11000000000105
 #define hypercall_enum_vclock_op__set_guest_wallclock_rtc 0xBF11000000000106
 #define hypercall_enum_vclock_op__set_guest_wallclock_tsc 0xBF11000000000107
 #define hypercall_enum_vclock_op__get_guest_wallclock 0xBF11000000000108
+#define hypercall_enum_vclock_op__set_vclock_page 0xBF11000000000109
+#define hypercall_enum_vclock_op__sync_next_event 0xBF1100000000010A
+#define hypercall_enum_vclock_op__set_host_wallclock 0xBF1100000000010B
+#define hypercall_enum_vclock_op__set_steal_time_page 0xBF1100000000010C
+
+/*
+ * vClock Page
+ *
+ * The vClock page is a per-vCPU page that is laid out the same way as the
+ * pvclock ABI (i.e. pvclock_vcpu_time_info followed by pvclock_wall_clock)
+ * so that a guest can read the time without a VM exit. The hypervisor
+ * updates the page when the guest's wall clock is set, and the version is
+ * odd while an update is in progress, and the page must be page aligned.
+ * The guest computes the time as follows:
+ *
+ * delta = rdtsc() - time.tsc_timestamp
+ * delta = tsc_shift < 0 ? delta >> -tsc_shift : delta << tsc_shift
+ * nsec  = time.system_time + ((delta * tsc_to_system_mul) >> 32)
+ * now   = wall_clock + nsec
+ *
+ * The vClock page also provides next_event_tsc, which lets the guest arm
+ * its clock event without a VM exit. The guest writes the absolute TSC of
+ * its next event, and the hypervisor consumes it (i.e. sets it back to 0)
+ * the next time the vCPU is resumed. If the new deadline is earlier than
+ * the current one, the guest has to call
+ * hypercall_vclock_op__sync_next_event so that the hypervisor picks it up
+ * right away.
+ */
+
+#define BOXY_PVCLOCK_TSC_STABLE_BIT (1U << 0)
+
+#pragma pack(push, 8)
+
+struct boxy_pvclock_vcpu_time_info {
+    uint32_t version;
+    uint32_t pad0;
+    uint64_t tsc_timestamp;
+    uint64_t system_time;
+    uint32_t tsc_to_system_mul;
+    int8_t tsc_shift;
+    uint8_t flags;
+    uint8_t pad[2];
+};
+
+struct boxy_pvclock_wall_clock {
+    uint32_t version;
+    uint32_t sec;
+    uint32_t nsec;
+};
+
+struct boxy_vclock_page {
+    struct boxy_pvclock_vcpu_time_info time;
+    struct boxy_pvclock_wall_clock wall_clock;
+    uint64_t next_event_tsc;
+};
+
+#pragma pack(pop)
+
+/*
+ * Steal Time
+ *
+ * The steal time area is laid out the same way as KVM's kvm_steal_time so
+ * that a guest's existing steal time support can be used. steal is the
+ * total amount of time (in nanoseconds) that the vCPU was runnable, but
+ * not running, and preempted is non-zero while the vCPU is preempted. The
+ * version is odd while an update is in progress, and the area must be 64
+ * byte aligned.
+ */
+
+#pragma pack(push, 8)
+
+struct boxy_steal_time {
+    uint64_t steal;
+    uint32_t version;
+    uint32_t flags;
+    uint8_t preempted;
+    uint8_t pad0[3];
+    uint32_t pad1[11];
+};
+
+#pragma pack(pop)
 
 static inline uint64_t
 hypercall_vclock_op__get_tsc_freq_khz(void)
@@ -655,42 +1089,54 @@ hypercall_vclock_op__reset_host_wallclock(void)
 }
 
 static inline status_t
-hypercall_vclock_op__set_host_wallclock_rtc(
-    vcpuid_t vcpuid, int64_t sec, int64_t nsec)
+hypercall_vclock_op__set_host_wallclock(
+    int64_t sec, int64_t nsec, uint64_t tsc)
 {
     return _vmcall(
-        hypercall_enum_vclock_op__set_host_wallclock_rtc,
-        vcpuid,
+        hypercall_enum_vclock_op__set_host_wallclock,
         bfscast(uint64_t, sec),
-        bfscast(uint64_t, nsec)
+        bfscast(uint64_t, nsec),
+        tsc
     );
 }
 
 static inline status_t
-hypercall_vclock_op__set_host_wallclock_tsc(
-    vcpuid_t vcpuid, uint64_t val)
+hypercall_vclock_op__set_guest_wallclock_rtc(void)
 {
     return _vmcall(
-        hypercall_enum_vclock_op__set_host_wallclock_tsc,
-        vcpuid,
-        val,
-        0
+        hypercall_enum_vclock_op__set_guest_wallclock_rtc, 0, 0, 0
     );
 }
 
 static inline status_t
-hypercall_vclock_op__set_guest_wallclock_rtc(void)
+hypercall_vclock_op__set_guest_wallclock_tsc(void)
 {
     return _vmcall(
-        hypercall_enum_vclock_op__set_guest_wallclock_rtc, 0, 0, 0
+        hypercall_enum_vclock_op__set_guest_wallclock_tsc, 0, 0, 0
     );
 }
 
 static inline status_t
-hypercall_vclock_op__set_guest_wallclock_tsc(void)
+hypercall_vclock_op__set_vclock_page(uint64_t gpa)
 {
     return _vmcall(
-        hypercall_enum_vclock_op__set_guest_wallclock_tsc, 0, 0, 0
+        hypercall_enum_vclock_op__set_vclock_page, gpa, 0, 0
+    );
+}
+
+static inline status_t
+hypercall_vclock_op__set_steal_time_page(uint64_t gpa)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__set_steal_time_page, gpa, 0, 0
+    );
+}
+
+static inline status_t
+hypercall_vclock_op__sync_next_event(void)
+{
+    return _vmcall(
+        hypercall_enum_vclock_op__sync_next_event, 0, 0, 0
     );
 }
 
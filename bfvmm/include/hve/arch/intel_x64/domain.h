@@ -22,8 +22,11 @@
 #ifndef DOMAIN_INTEL_X64_BOXY_H
 #define DOMAIN_INTEL_X64_BOXY_H
 
+#include <atomic>
 #include <vector>
 #include <memory>
+#include <mutex>
+#include <unordered_map>
 
 #include "uart.h"
 #include "../../../domain/domain.h"
@@ -181,7 +184,9 @@ public:
 
     /// Unmap GPA
     ///
-    /// Unmaps a guest physical address
+    /// Unmaps a guest physical address. Throws if any of the domain's vCPUs
+    /// are running, as they might still have the mapping cached, in which
+    /// case the mapping is removed, but the memory must not be reused.
     ///
     /// @expects
     /// @ensures
@@ -196,7 +201,8 @@ public:
     /// providing a means to reconfigure the granularity of a previous mapping.
     ///
     /// @note that unmap must be run for any existing mappings, otherwise this
-    ///     function has no effect.
+    ///     function has no effect. Like unmap, this throws if any of the
+    ///     domain's vCPUs are running.
     ///
     /// @expects
     /// @ensures
@@ -205,6 +211,33 @@ public:
     ///
     void release(uintptr_t gpa);
 
+    /// EPT Generation
+    ///
+    /// Returns the number of times any domain has removed a mapping from its
+    /// EPT. A physical CPU that last flushed its EPT derived translations at
+    /// an older generation must flush them before its next VM entry.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the current EPT generation
+    ///
+    static uint64_t ept_generation() noexcept;
+
+    /// Set vCPU Running
+    ///
+    /// Keeps track of how many of the domain's vCPUs are running, so that
+    /// unmap and release can tell if a vCPU might still be using a mapping
+    /// that is being removed. This must be called before the vCPU's next
+    /// VM entry when it starts running, and once it has stopped.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param running true if the vCPU started running, false if it stopped
+    ///
+    void set_vcpu_running(bool running) noexcept;
+
 public:
 
     /// Set UART
@@ -257,6 +290,128 @@ public:
     ///
     uint64_t dump_uart(const gsl::span<char> &buffer);
 
+    /// Set UART Ring
+    ///
+    /// Provides the emulated UART with a ring to write its output to,
+    /// instead of buffering the output until dump_uart is called. Note that
+    /// set_uart must be executed for this function to have an effect.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param ring the ring to write the UART's output to
+    ///
+    void set_uart_ring(bfvmm::x64::unique_map<boxy_uart_ring> &&ring);
+
+    /// Write UART
+    ///
+    /// Gives input to the emulated UART, which the guest can then read.
+    /// Note that set_uart must be executed for this function to have an
+    /// effect.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param buffer the input to give to the guest
+    /// @return the number of bytes the UART accepted
+    ///
+    uint64_t write_uart(const gsl::span<const char> &buffer);
+
+    /// UART IRQ Pending
+    ///
+    /// Returns true if the emulated UART has an interrupt for the guest that
+    /// has not been delivered yet. This can be called from any physical CPU,
+    /// which is how a vCPU that is polling for its next event sees input that
+    /// was given to the UART by dom0.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if the emulated UART's interrupt is pending
+    ///
+    bool uart_irq_pending() const noexcept;
+
+    /// Dump UART (Registered Buffer)
+    ///
+    /// Same as dump_uart, but dumps the contents of the active UART to a
+    /// buffer that was registered with register_buffer, which does not need
+    /// to be mapped again. The buffer must be at least UART_MAX_BUFFER bytes.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param handle the handle of the buffer to dump the UART into
+    /// @return the number of bytes transferred to the buffer, or FAILURE if
+    ///     the handle is unknown or its buffer is too small
+    ///
+    uint64_t dump_uart(uint64_t handle);
+
+public:
+
+    /// Register Buffer
+    ///
+    /// Keeps a mapping of a dom0 buffer so that hypercalls that move data to
+    /// or from this domain can refer to the buffer by handle instead of
+    /// mapping it each time they are made. The mapping is kept until the
+    /// buffer is unregistered or this domain is destroyed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param map the mapping of the buffer to register
+    /// @param size the size of the buffer in bytes
+    /// @return the buffer's handle, or INVALID_BUFFER if BOXY_MAX_BUFFERS
+    ///     buffers are already registered
+    ///
+    uint64_t register_buffer(bfvmm::x64::unique_map<char> &&map, uint64_t size);
+
+    /// Unregister Buffer
+    ///
+    /// Releases the mapping of a buffer that was registered with
+    /// register_buffer.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param handle the handle of the buffer to unregister
+    /// @return true if the buffer was registered, false otherwise
+    ///
+    bool unregister_buffer(uint64_t handle);
+
+public:
+
+    /// Set CPU Quota
+    ///
+    /// Limits each of the domain's vCPUs to running for at most quota TSC
+    /// ticks in every period. A quota or period of 0 removes the limit.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param quota the amount of time (in TSC ticks) a vCPU can run for
+    ///     in each period
+    /// @param period the length of a period (in TSC ticks)
+    ///
+    void set_cpu_quota(uint64_t quota, uint64_t period) noexcept;
+
+    /// CPU Quota
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's CPU quota (in TSC ticks)
+    ///
+    uint64_t cpu_quota() const noexcept;
+
+    /// CPU Period
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the domain's CPU period (in TSC ticks)
+    ///
+    uint64_t cpu_period() const noexcept;
+
 public:
 
     /// Domain Registers
@@ -407,6 +562,7 @@ private:
 
     bfvmm::intel_x64::ept::mmap m_ept_map;
     bfvmm::intel_x64::vcpu_global_state_t m_vcpu_global_state;
+    std::atomic<uint64_t> m_running_vcpus{};
 
     uart::port_type m_uart_port{};
     uart::port_type m_pt_uart_port{};
@@ -416,6 +572,18 @@ private:
     uart m_uart_2E8{0x2E8};
     std::unique_ptr<uart> m_pt_uart{};
 
+    struct registered_buffer {
+        bfvmm::x64::unique_map<char> map;
+        uint64_t size;
+    };
+
+    std::mutex m_buffers_mutex{};
+    std::unordered_map<uint64_t, registered_buffer> m_buffers{};
+    uint64_t m_next_buffer_handle{};
+
+    uint64_t m_cpu_quota{};
+    uint64_t m_cpu_period{};
+
     uint64_t m_rax{};
     uint64_t m_rbx{};
     uint64_t m_rcx{};
@@ -504,4 +672,18 @@ public:
 #define get_domain(a) \
     g_dm->get<boxy::intel_x64::domain *>(a, "invalid domainid: " __FILE__)
 
+/// Try Get Domain
+///
+/// Same as get_domain, with the exception that an invalid domain id is not
+/// considered an error. This should be used by hypercalls so that a bad
+/// domain id from a caller is reported as a status code and not an exception.
+///
+/// @expects
+/// @ensures
+///
+/// @return returns a pointer to the domain being queried or nullptr
+///
+#define try_get_domain(a) \
+    g_dm->get<boxy::intel_x64::domain *>(a)
+
 #endif
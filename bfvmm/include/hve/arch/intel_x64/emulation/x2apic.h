@@ -64,6 +64,10 @@ public:
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x0000001B(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x000006E0(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
     bool handle_rdmsr_0x00000802(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
@@ -152,6 +156,10 @@ public:
     bool handle_wrmsr_0x00000827(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    bool handle_rdmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000832(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
     bool handle_rdmsr_0x00000835(
         vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
     bool handle_wrmsr_0x00000835(
@@ -165,8 +173,27 @@ public:
     bool handle_wrmsr_0x00000837(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    bool handle_rdmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000838(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x00000839(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x00000839(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+    bool handle_rdmsr_0x0000083E(
+        vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info);
+    bool handle_wrmsr_0x0000083E(
+        vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
+
     /// @endcond
 
+private:
+
+    uint64_t timer_mode() const noexcept;
+    uint64_t timer_divide_shift() const noexcept;
+    uint64_t timer_initial_tsc() const noexcept;
+
 private:
 
     vcpu *m_vcpu;
@@ -194,10 +221,14 @@ private:
     uint64_t m_0x00000826{0};
     uint64_t m_0x00000827{0};
 
+    uint64_t m_0x00000832{1U << 16U};
     uint64_t m_0x00000835{1U << 16U};
     uint64_t m_0x00000836{1U << 16U};
     uint64_t m_0x00000837{1U << 16U};
 
+    uint64_t m_0x00000838{0};
+    uint64_t m_0x0000083E{0};
+
 public:
 
     /// @cond
@@ -30,6 +30,7 @@
 #include <mutex>
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/cpuid.h>
 #include <bfvmm/hve/arch/intel_x64/vmexit/io_instruction.h>
 
@@ -119,6 +120,47 @@ public:
     ///
     uint64_t dump(const gsl::span<char> &buffer);
 
+    /// Set Ring
+    ///
+    /// Once a ring is provided, all output from the UART is written to the
+    /// ring instead of the UART's buffer (any output that is still in the
+    /// UART's buffer is moved into the ring). Providing an empty map
+    /// removes the ring, and output is buffered again.
+    ///
+    /// @param ring the ring to write the UART's output to
+    ///
+    void set_ring(bfvmm::x64::unique_map<boxy_uart_ring> &&ring);
+
+    /// Receive
+    ///
+    /// Adds input (e.g. from the user's terminal) to the UART's receive
+    /// buffer, where it can be read by the guest. If the guest has enabled
+    /// the receive interrupt, a vIRQ is delivered to the guest the next
+    /// time one of its vCPUs is resumed.
+    ///
+    /// @param buffer the input to give to the guest
+    /// @return the number of bytes added to the receive buffer
+    ///
+    uint64_t receive(const gsl::span<const char> &buffer);
+
+    /// IRQ Pending
+    ///
+    /// Returns true if the UART has an interrupt for the guest that has not
+    /// been delivered yet. This can be called from any physical CPU.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return true if the UART's interrupt is pending
+    ///
+    bool irq_pending() const noexcept;
+
+    /// @cond
+
+    void resume_delegate(vcpu_t *vcpu);
+
+    /// @endcond
+
 private:
 
     bool io_zero_handler(
@@ -160,13 +202,25 @@ private:
     bool reg7_out_handler(
         vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info);
 
+    bool rep_outs_handler(
+        vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info,
+        bfvmm::x64::unique_map<char> &str, uint64_t &len);
+
     bool dlab() const
     { return m_line_control_register & 0x80; }
 
+    bool rx_ready() const
+    { return m_rx_head != m_rx_tail; }
+
+    void update_irq();
+
     void write(const char c);
     void write(const char *str);
+    void write(const char *buf, std::size_t len);
+    void write_ring(const char *buf, std::size_t len);
 
     bool vmcall_dispatch(vcpu *vcpu);
+    void uart_op__write(vcpu *vcpu);
 
 private:
 
@@ -175,11 +229,19 @@ private:
     std::mutex m_mutex{};
     std::size_t m_index{};
     std::array<char, UART_MAX_BUFFER> m_buffer{};
+    bfvmm::x64::unique_map<boxy_uart_ring> m_ring{};
 
     data_type m_baud_rate_l{};
     data_type m_baud_rate_h{};
     data_type m_line_control_register{};
+    data_type m_interrupt_enable_register{};
+
+    bool m_thre_pending{};
+    bool m_irq_pending{};
 
+    uint64_t m_rx_head{};
+    uint64_t m_rx_tail{};
+    std::array<char, UART_MAX_BUFFER> m_rx_buffer{};
 };
 
 }
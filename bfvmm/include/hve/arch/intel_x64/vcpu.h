@@ -44,6 +44,7 @@
 #include "emulation/x2apic.h"
 
 #include "virt/vclock.h"
+#include "virt/quota.h"
 #include "virt/virq.h"
 
 //------------------------------------------------------------------------------
@@ -112,6 +113,36 @@ public:
     ///
     VIRTUAL domain::domainid_type domid() const noexcept;
 
+    /// Domain
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return the vCPU's domain
+    ///
+    VIRTUAL domain *dom() const noexcept;
+
+    //--------------------------------------------------------------------------
+    // VMCS
+    //--------------------------------------------------------------------------
+
+    /// Load
+    ///
+    /// Loads this vCPU's VMCS (i.e. VMPTRLD). If this vCPU's VMCS is already
+    /// the current VMCS of this physical CPU (as reported by VMPTRST), this
+    /// function does nothing.
+    ///
+    /// Note:
+    ///
+    /// bfvmm::intel_x64::vcpu::load() is not virtual, so calling load()
+    /// through a base vCPU pointer always performs a VMPTRLD. This is only
+    /// slower, as the check does not depend on how the VMCS was loaded.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    VIRTUAL void load();
+
     //--------------------------------------------------------------------------
     // VMCall
     //--------------------------------------------------------------------------
@@ -121,9 +152,25 @@ public:
     /// @expects
     /// @ensures
     ///
+    /// @param opcode the hypercall opcode (i.e. bfopcode(rax)) to handle
     /// @param d the delegate to call when a vmcall exit occurs
     ///
-    VIRTUAL void add_vmcall_handler(const handler_delegate_t &d);
+    VIRTUAL void add_vmcall_handler(
+        uint64_t opcode, const handler_delegate_t &d);
+
+    /// Add Fast VMCall Handler
+    ///
+    /// Fast handlers do not reload the vCPU's VMCS once they complete, and
+    /// as such, must not load another vCPU's VMCS.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param opcode the hypercall opcode (i.e. bfopcode(rax)) to handle
+    /// @param d the delegate to call when a vmcall exit occurs
+    ///
+    VIRTUAL void add_fast_vmcall_handler(
+        uint64_t opcode, const handler_delegate_t &d);
 
     //--------------------------------------------------------------------------
     // Hlt
@@ -195,7 +242,8 @@ public:
     /// Prepare For World Switch
     ///
     /// Prepares the vCPU for a world switch. This ensures that portions of
-    /// the vCPU's state is properly restored.
+    /// the vCPU's state is properly restored. Like load(), the state is only
+    /// restored if the physical CPU does not already hold this vCPU's state.
     ///
     VIRTUAL void prepare_for_world_switch();
 
@@ -225,14 +273,17 @@ public:
     /// Return (Yield)
     ///
     /// Return to the parent vCPU (i.e. resume the parent), and tell the parent
-    /// to put the child vCPU asleep for the specified number of nanoseconds
+    /// to put the child vCPU asleep until the TSC reaches the provided
+    /// deadline. An absolute deadline is returned (instead of a relative
+    /// amount of time) so that the time it takes to get back to the parent
+    /// is not added to the amount of time the child sleeps.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param nsec the number of nanoseconds to sleep
+    /// @param tsc the TSC value to sleep until
     ///
-    VIRTUAL void return_yield(uint64_t nsec);
+    VIRTUAL void return_yield(uint64_t tsc);
 
     /// Return (Set Wall Clock)
     ///
@@ -275,6 +326,45 @@ public:
     ///
     VIRTUAL bool is_killed() const noexcept;
 
+    //--------------------------------------------------------------------------
+    // Run State
+    //--------------------------------------------------------------------------
+
+    /// Set Run State
+    ///
+    /// Moves the vCPU into the provided run state (BOXY_RUNSTATE_xxx). The
+    /// time since the last change is added to the time spent in the
+    /// previous run state, and the guest's steal time is updated.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param state the vCPU's new run state
+    ///
+    VIRTUAL void set_runstate(uint64_t state) noexcept;
+
+    /// Run State
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the vCPU's run state info. The time spent in each
+    ///     run state (in TSC ticks) includes the vCPU's current run state
+    ///     up to now.
+    ///
+    VIRTUAL struct boxy_runstate_info runstate() const noexcept;
+
+    /// Quota Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the absolute TSC at which the vCPU will have used up
+    ///     its domain's CPU quota for the current period, or 0 if the
+    ///     vCPU's domain does not have a CPU quota
+    ///
+    VIRTUAL uint64_t quota_deadline() noexcept;
+
     //--------------------------------------------------------------------------
     // Virtual IRQs
     //--------------------------------------------------------------------------
@@ -305,44 +395,43 @@ public:
     ///
     VIRTUAL void inject_virtual_interrupt(uint64_t vector);
 
-    //--------------------------------------------------------------------------
-    // Virtual Clock
-    //--------------------------------------------------------------------------
-
-    /// Set Host Wall Clock Real Time Clock
-    ///
-    /// Records the provided wall clock RTC
+    /// Has Pending vIRQs
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param val the wall clock RTC
+    /// @return returns true if vIRQs are waiting to be dequeued by the
+    ///     guest, false otherwise
     ///
-    VIRTUAL void set_host_wallclock_rtc(uint64_t sec, uint64_t nsec) noexcept;
+    VIRTUAL bool has_pending_virtual_interrupts() const noexcept;
+
+    //--------------------------------------------------------------------------
+    // Virtual Clock
+    //--------------------------------------------------------------------------
 
-    /// Set Host Wall Clock TSC
+    /// Set Host Wall Clock
     ///
-    /// Records the wall clock TSC
+    /// Records the provided wall clock RTC and the TSC that was captured
+    /// with it. Note that there is only one host wall clock, which is
+    /// shared by all of the vCPUs (and domains).
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param val the wall clock TSC
+    /// @param sec the wall clock RTC (seconds)
+    /// @param nsec the wall clock RTC (nanoseconds)
+    /// @param tsc the TSC that was captured with the wall clock RTC
     ///
-    VIRTUAL void set_host_wallclock_tsc(uint64_t val) noexcept;
+    VIRTUAL void set_host_wallclock(
+        uint64_t sec, uint64_t nsec, uint64_t tsc) noexcept;
 
     /// Reset Host Wall Clock
     ///
-    /// Resets the host Wall Clock. Once this is executed, any attempt to
-    /// launch a vCPU (i.e. a vCPU that has never been run, or has been
-    /// cleared) will cause the lanuch to return back to bfexec so that the
-    /// host wall clock can be reread.
-    ///
-    /// Note:
-    ///
-    /// This does not work the same way as the reset_host_wallclock hypercall.
-    /// That hypercall performs the return on-behalf of the guest. This
-    /// performs the return on-behalf of the host.
+    /// Resets the host Wall Clock. Once this is executed, the next guest
+    /// that asks for the host wall clock (i.e. the reset_host_wallclock
+    /// hypercall) will return back to bfexec so that the host wall clock
+    /// can be reread. Since the host wall clock is shared, this only needs
+    /// to be executed once.
     ///
     /// @expects
     /// @ensures
@@ -351,9 +440,8 @@ public:
 
     /// Get the Host Wall Clock
     ///
-    /// Returns the host's Wall Clock from epoch. This function will throw
-    /// if the set_host_wallclock_rtc and set_host_wallclock_tsc functions
-    /// have not yet been called.
+    /// Returns the host's Wall Clock from epoch. The result is meaningless
+    /// if set_host_wallclock has not yet been called.
     ///
     /// @expects
     /// @ensures
@@ -362,6 +450,31 @@ public:
     ///
     VIRTUAL std::pair<struct timespec, uint64_t> get_host_wallclock() const;
 
+    /// Set LAPIC Timer
+    ///
+    /// Arms the emulated LAPIC timer. Once the deadline is reached, the
+    /// vector in the provided LVT timer register is delivered to the guest.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param lvt the value of the LVT timer register
+    /// @param deadline the absolute TSC to expire at (0 disarms the timer)
+    /// @param period the period in TSC ticks (0 for a one-shot timer)
+    ///
+    VIRTUAL void set_lapic_timer(
+        uint64_t lvt, uint64_t deadline, uint64_t period) noexcept;
+
+    /// LAPIC Timer Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the absolute TSC at which the emulated LAPIC timer
+    ///     will expire, or 0 if the timer is disarmed
+    ///
+    VIRTUAL uint64_t lapic_timer_deadline() const noexcept;
+
     //--------------------------------------------------------------------------
     // Fault
     //--------------------------------------------------------------------------
@@ -384,14 +497,22 @@ private:
     void setup_default_register_state();
     void setup_default_controls();
     void setup_default_handlers();
+    void setup_vpid();
+
+    void flush_stale_translations(vcpu_t *vcpu);
 
 private:
 
     domain *m_domain{};
+    uintptr_t m_vmcs_phys{};
+    uint16_t m_vpid{};
+    uint64_t m_last_cpu_tag{};
 
     bool m_killed{};
     vcpu *m_parent_vcpu{};
 
+    struct boxy_runstate_info m_runstate{};
+
 private:
 
     external_interrupt_handler m_external_interrupt_handler;
@@ -411,6 +532,7 @@ private:
 
     vclock_handler m_vclock_handler;
     virq_handler m_virq_handler;
+    quota_handler m_quota_handler;
 };
 
 }
@@ -448,6 +570,20 @@ private:
 #define get_vcpu(a) \
     g_vcm->get<boxy::intel_x64::vcpu *>(a, __FILE__ ": invalid boxy vcpuid")
 
+/// Try Get Guest vCPU
+///
+/// Same as get_vcpu, with the exception that an invalid vcpuid is not
+/// considered an error. This should be used by hypercalls so that a bad
+/// vcpuid from a caller is reported as a status code and not an exception.
+///
+/// @expects
+/// @ensures
+///
+/// @return returns a pointer to the vCPU being queried or nullptr
+///
+#define try_get_vcpu(a) \
+    g_vcm->get<boxy::intel_x64::vcpu *>(a)
+
 /// Boxy vCPU Cast
 ///
 /// To keeps things simple, this is a Boxy specific vCPU cast so that we can
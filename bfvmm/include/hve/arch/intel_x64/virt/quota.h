@@ -0,0 +1,105 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#ifndef VIRT_QUOTA_INTEL_X64_BOXY_H
+#define VIRT_QUOTA_INTEL_X64_BOXY_H
+
+#include <bfvmm/hve/arch/intel_x64/vcpu.h>
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+class vcpu;
+
+class quota_handler
+{
+public:
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this handler
+    ///
+    quota_handler(
+        gsl::not_null<vcpu *> vcpu);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~quota_handler() = default;
+
+public:
+
+    /// Deadline
+    ///
+    /// Returns the absolute TSC at which the vCPU will have used up its
+    /// CPU quota for the current period. If the quota has already been used
+    /// up, the current TSC is returned. If a new period has started, the
+    /// quota is replenished first.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the TSC at which the vCPU must be throttled, or 0
+    ///     if the vCPU's domain does not have a CPU quota
+    ///
+    uint64_t deadline() noexcept;
+
+public:
+
+    /// @cond
+
+    bool handle_preemption_timer(vcpu *vcpu);
+
+    /// @endcond
+
+private:
+
+    vcpu *m_vcpu;
+
+    uint64_t m_period_start_tsc{};
+    uint64_t m_period_start_running_tsc{};
+
+public:
+
+    /// @cond
+
+    quota_handler(quota_handler &&) = default;
+    quota_handler &operator=(quota_handler &&) = default;
+
+    quota_handler(const quota_handler &) = delete;
+    quota_handler &operator=(const quota_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+
+#endif
@@ -23,6 +23,9 @@
 #define VIRT_VCLOCK_INTEL_X64_BOXY_H
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+#include <bfhypercall.h>
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -51,40 +54,29 @@ public:
     // Host Time
     //--------------------------------------------------------------------------
 
-    /// Set Host Wall Clock Real Time Clock
-    ///
-    /// Records the provided wall clock RTC
-    ///
-    /// @expects
-    /// @ensures
-    ///
-    /// @param val the wall clock RTC
-    ///
-    VIRTUAL void set_host_wallclock_rtc(uint64_t sec, uint64_t nsec) noexcept;
-
-    /// Set Host Wall Clock TSC
+    /// Set Host Wall Clock
     ///
-    /// Records the wall clock TSC
+    /// Records the provided wall clock RTC and the TSC that was captured
+    /// with it. Note that there is only one host wall clock, which is
+    /// shared by all of the vCPUs (and domains).
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param val the wall clock TSC
+    /// @param sec the wall clock RTC (seconds)
+    /// @param nsec the wall clock RTC (nanoseconds)
+    /// @param tsc the TSC that was captured with the wall clock RTC
     ///
-    VIRTUAL void set_host_wallclock_tsc(uint64_t val) noexcept;
+    VIRTUAL void set_host_wallclock(
+        uint64_t sec, uint64_t nsec, uint64_t tsc) noexcept;
 
     /// Reset Host Wall Clock
     ///
-    /// Resets the host Wall Clock. Once this is executed, any attempt to
-    /// launch a vCPU (i.e. a vCPU that has never been run, or has been
-    /// cleared) will cause the lanuch to return back to bfexec so that the
-    /// host wall clock can be reread.
-    ///
-    /// Note:
-    ///
-    /// This does not work the same way as the reset_host_wallclock hypercall.
-    /// That hypercall performs the return on-behalf of the guest. This
-    /// performs the return on-behalf of the host.
+    /// Resets the host Wall Clock. Once this is executed, the next guest
+    /// that asks for the host wall clock (i.e. the reset_host_wallclock
+    /// hypercall) will return back to bfexec so that the host wall clock
+    /// can be reread. Since the host wall clock is shared, this only needs
+    /// to be executed once.
     ///
     /// @expects
     /// @ensures
@@ -93,9 +85,8 @@ public:
 
     /// Get the Host Wall Clock
     ///
-    /// Returns the host's Wall Clock from epoch. This function will throw
-    /// if the set_host_wallclock_rtc and set_host_wallclock_tsc functions
-    /// have not yet been called.
+    /// Returns the host's Wall Clock from epoch. The result is meaningless
+    /// if set_host_wallclock has not yet been called.
     ///
     /// @expects
     /// @ensures
@@ -139,6 +130,57 @@ public:
     ///
     VIRTUAL std::pair<struct timespec, uint64_t> get_guest_wallclock() const;
 
+    //--------------------------------------------------------------------------
+    // Steal Time
+    //--------------------------------------------------------------------------
+
+    /// Update Steal Time
+    ///
+    /// Publishes the amount of time the vCPU has been runnable (but not
+    /// running) to the guest's steal time area, if the guest has
+    /// registered one.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param steal_tsc the total time (in TSC ticks) spent runnable
+    /// @param preempted true if the vCPU is currently preempted
+    ///
+    VIRTUAL void update_steal_time(uint64_t steal_tsc, bool preempted) noexcept;
+
+    //--------------------------------------------------------------------------
+    // LAPIC Timer
+    //--------------------------------------------------------------------------
+
+    /// Set LAPIC Timer
+    ///
+    /// Arms the emulated LAPIC timer. The LAPIC timer shares the VMX
+    /// preemption timer with the vClock event device, and is armed by the
+    /// resume delegate. Once the deadline is reached, the vector in the
+    /// provided LVT timer register is delivered to the guest (unless it is
+    /// masked). If a period is provided, the timer is rearmed each time it
+    /// expires.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param lvt the value of the LVT timer register
+    /// @param deadline the absolute TSC to expire at (0 disarms the timer)
+    /// @param period the period in TSC ticks (0 for a one-shot timer)
+    ///
+    VIRTUAL void set_lapic_timer(
+        uint64_t lvt, uint64_t deadline, uint64_t period) noexcept;
+
+    /// LAPIC Timer Deadline
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns the absolute TSC at which the emulated LAPIC timer
+    ///     will expire, or 0 if the timer is disarmed
+    ///
+    VIRTUAL uint64_t lapic_timer_deadline() const noexcept;
+
     //--------------------------------------------------------------------------
     // Time Helpers
     //--------------------------------------------------------------------------
@@ -156,9 +198,9 @@ public:
     ///
     /// Note:
     ///
-    /// This function will perform the conversions without fear of overflow.
-    /// For this reason, if large number conversions are needed, this is
-    /// the function that you should use.
+    /// This function will perform the conversions without fear of overflow
+    /// and without a divide, using the multiplier and shift that are given
+    /// to the guest in the vClock page (calculated once on construction).
     ///
     /// @expects
     /// @ensures
@@ -172,9 +214,9 @@ public:
     ///
     /// Note:
     ///
-    /// This function will perform the conversions without fear of overflow.
-    /// For this reason, if large number conversions are needed, this is
-    /// the function that you should use.
+    /// This function will perform the conversions without fear of overflow
+    /// and without a divide, using a multiplier and shift that are
+    /// calculated once on construction.
     ///
     /// @expects
     /// @ensures
@@ -194,11 +236,13 @@ public:
     void vclock_op__get_tsc_freq_khz(vcpu *vcpu);
     void vclock_op__set_next_event(vcpu *vcpu);
     void vclock_op__reset_host_wallclock(vcpu *vcpu);
-    void vclock_op__set_host_wallclock_rtc(vcpu *vcpu);
-    void vclock_op__set_host_wallclock_tsc(vcpu *vcpu);
+    void vclock_op__set_host_wallclock(vcpu *vcpu);
     void vclock_op__set_guest_wallclock_rtc(vcpu *vcpu);
     void vclock_op__set_guest_wallclock_tsc(vcpu *vcpu);
     void vclock_op__get_guest_wallclock(vcpu *vcpu);
+    void vclock_op__set_vclock_page(vcpu *vcpu);
+    void vclock_op__sync_next_event(vcpu *vcpu);
+    void vclock_op__set_steal_time_page(vcpu *vcpu);
 
     bool dispatch_dom0(vcpu *vcpu);
     bool dispatch_domU(vcpu *vcpu);
@@ -215,6 +259,17 @@ private:
     void queue_vclock_event();
     void inject_vclock_event();
 
+    void queue_lapic_timer_event(uint64_t tsc);
+    bool queue_expired_events(uint64_t tsc);
+    uint64_t next_deadline() const noexcept;
+
+    bool halt_poll(vcpu *vcpu, uint64_t next_event);
+    void adjust_halt_poll(uint64_t tsc) noexcept;
+
+    void update_vclock_page() noexcept;
+    void sync_next_event() noexcept;
+    void resync_guest_wallclock() noexcept;
+
 private:
 
     vcpu *m_vcpu;
@@ -223,11 +278,28 @@ private:
     uint64_t m_pet_decrement{};
     uint64_t m_next_event_tsc{};
 
-    uint64_t m_host_wc_tsc{};
-    struct timespec m_host_wc_rtc{};
+    uint64_t m_lapic_timer_lvt{};
+    uint64_t m_lapic_timer_deadline_tsc{};
+    uint64_t m_lapic_timer_period_tsc{};
+
+    uint64_t m_halt_poll_tsc{};
+    uint64_t m_halt_poll_min_tsc{};
+    uint64_t m_halt_poll_max_tsc{};
+    uint64_t m_halt_poll_start_tsc{};
+
+    uint64_t m_host_wc_gen{};
+
     uint64_t m_guest_wc_tsc{};
+    uint64_t m_guest_wc_nsec{};
     struct timespec m_guest_wc_rtc{};
 
+    uint32_t m_pvclock_mul{};
+    int8_t m_pvclock_shift{};
+    uint32_t m_nsec_to_tsc_mul{};
+    int8_t m_nsec_to_tsc_shift{};
+    bfvmm::x64::unique_map<boxy_vclock_page> m_vclock_page;
+    bfvmm::x64::unique_map<boxy_steal_time> m_steal_time_page;
+
 public:
 
     /// @cond
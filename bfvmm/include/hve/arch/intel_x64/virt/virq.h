@@ -24,6 +24,9 @@
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
 #include <bfvmm/hve/arch/intel_x64/interrupt_queue.h>
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+#include <bfhypercall.h>
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -65,6 +68,10 @@ public:
     /// vIRQ vector. Also note that all vIRQs are essentially vMSIs so once
     /// the vIRQ is dequeued, it is gone.
     ///
+    /// If the guest has registered a vIRQ page, the vIRQ is marked pending
+    /// in the page instead, and the Hypervisor Callback Vector IRQ is only
+    /// queued if the vIRQ is not masked and the callback is armed.
+    ///
     /// @expects
     /// @ensures
     ///
@@ -83,23 +90,39 @@ public:
     ///
     void inject_virtual_interrupt(uint64_t vector);
 
+    /// Has Pending vIRQs
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if vIRQs are waiting to be dequeued by the
+    ///     guest, false otherwise
+    ///
+    bool has_pending_virtual_interrupts() const noexcept;
+
 public:
 
     /// @cond
 
     void virq_op__set_hypervisor_callback_vector(vcpu *vcpu);
     void virq_op__get_next_virq(vcpu *vcpu);
+    void virq_op__set_virq_page(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
     /// @endcond
 
+private:
+
+    bool set_pending(uint64_t vector) noexcept;
+
 private:
 
     vcpu *m_vcpu;
 
     uint64_t m_hypervisor_callback_vector{};
     bfvmm::intel_x64::interrupt_queue m_interrupt_queue;
+    bfvmm::x64::unique_map<boxy_virq_page> m_virq_page;
 
 public:
 
@@ -60,6 +60,14 @@ private:
     void domain_op__set_uart(vcpu *vcpu);
     void domain_op__set_pt_uart(vcpu *vcpu);
     void domain_op__dump_uart(vcpu *vcpu);
+    void domain_op__set_uart_ring(vcpu *vcpu);
+    void domain_op__write_uart(vcpu *vcpu);
+    void domain_op__dump_uart_buffer(vcpu *vcpu);
+
+    void domain_op__set_cpu_quota(vcpu *vcpu);
+
+    void domain_op__register_buffer(vcpu *vcpu);
+    void domain_op__unregister_buffer(vcpu *vcpu);
 
     void domain_op__share_page_r(vcpu *vcpu);
     void domain_op__share_page_rw(vcpu *vcpu);
@@ -53,6 +53,19 @@ public:
     ///
     ~run_op_handler() = default;
 
+    /// Set Child Run State
+    ///
+    /// Sets the run state of the child vCPU that was last run by this
+    /// handler. This is used by the parent's return paths to record why
+    /// the child stopped running.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param state the child vCPU's new run state
+    ///
+    void set_child_runstate(uint64_t state) noexcept;
+
 private:
 
     bool dispatch(vcpu *vcpu);
@@ -61,8 +74,8 @@ private:
 
     vcpu *m_vcpu;
 
-    vcpu *m_child_vcpu;
-    vcpuid_t m_child_vcpuid;
+    vcpu *m_child_vcpu{};
+    vcpuid_t m_child_vcpuid{INVALID_VCPUID};
 
 public:
 
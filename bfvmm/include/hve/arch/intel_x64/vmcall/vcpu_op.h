@@ -57,6 +57,7 @@ private:
     void vcpu_op__create_vcpu(vcpu *vcpu);
     void vcpu_op__kill_vcpu(vcpu *vcpu);
     void vcpu_op__destroy_vcpu(vcpu *vcpu);
+    void vcpu_op__get_runstate(vcpu *vcpu);
 
     bool dispatch(vcpu *vcpu);
 
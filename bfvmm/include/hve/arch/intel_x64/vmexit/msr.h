@@ -56,7 +56,7 @@ public:
     /// @expects
     /// @ensures
     ///
-    ~msr_handler() = default;
+    ~msr_handler();
 
 public:
 
@@ -69,6 +69,8 @@ public:
     bool isolate_msr__on_write(
         vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info);
 
+    static void isolate_msr__reset() noexcept;
+
     /// @endcond
 
 public:
@@ -97,6 +99,7 @@ public:
 private:
 
     vcpu *m_vcpu;
+    uint64_t m_owner_id;
 
     uint64_t m_0xC0000103{0};
     std::unordered_map<uint32_t, uint64_t> m_msrs;
@@ -23,6 +23,9 @@
 #define VMEXIT_VMCALL_INTEL_X64_BOXY_H
 
 #include <bfvmm/hve/arch/intel_x64/vcpu.h>
+#include <bfvmm/memory_manager/arch/x64/unique_map.h>
+
+#include <bfhypercall.h>
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -59,25 +62,65 @@ public:
 
     /// Add Handler
     ///
-    /// @expects
+    /// Registers the handler for a hypercall opcode (i.e. bfopcode(rax)).
+    /// Only one handler can be registered per opcode, as the opcode is used
+    /// as an index into a dispatch table. Once the handler completes, the
+    /// vCPU's VMCS is reloaded as the handler might have loaded a different
+    /// VMCS (e.g. the run_op).
+    ///
+    /// @expects opcode has not already been registered
+    /// @ensures
+    ///
+    /// @param opcode the hypercall opcode this handler services
+    /// @param d the handler to call when an exit occurs
+    ///
+    void add_handler(uint64_t opcode, const handler_delegate_t &d);
+
+    /// Add Fast Handler
+    ///
+    /// Same as add_handler, with the exception that the vCPU's VMCS is not
+    /// reloaded once the handler completes. Only handlers that never load
+    /// another vCPU's VMCS (or reload their own VMCS before returning) should
+    /// be registered using this function.
+    ///
+    /// @expects opcode has not already been registered
     /// @ensures
     ///
+    /// @param opcode the hypercall opcode this handler services
     /// @param d the handler to call when an exit occurs
     ///
-    void add_handler(const handler_delegate_t &d);
+    void add_fast_handler(uint64_t opcode, const handler_delegate_t &d);
 
 public:
 
     /// @cond
 
     bool handle(vcpu_t *vcpu);
+    bool handle_multicall(vcpu *vcpu);
+
+    void multicall_op__multicall(vcpu *vcpu);
+    void multicall_op__set_multicall_page(vcpu *vcpu);
+    void multicall_op__multicall_page(vcpu *vcpu);
 
     /// @endcond
 
+private:
+
+    struct handler_t {
+        handler_delegate_t delegate;
+        bool enabled;
+        bool fast;
+    };
+
+    bool dispatch(const handler_t &handler);
+    void multicall(const gsl::span<struct hypercall_multicall_entry> &entries);
+
 private:
 
     vcpu *m_vcpu;
-    std::list<handler_delegate_t> m_handlers;
+    std::array<handler_t, 0x100> m_handlers{};
+
+    bfvmm::x64::unique_map<struct hypercall_multicall_entry> m_multicall_page;
 
 public:
 
@@ -21,6 +21,7 @@
 
 #include <bfdebug.h>
 #include <bfgpalayout.h>
+#include <intrinsics.h>
 
 #include <hve/arch/intel_x64/domain.h>
 
@@ -104,13 +105,64 @@ void
 domain::map_4k_rwe(uintptr_t gpa, uintptr_t hpa)
 { m_ept_map.map_4k(gpa, hpa, ept::mmap::attr_type::read_write_execute); }
 
+// Note:
+//
+// Translations that come from the EPT are tagged with the EPTP and not the
+// VPID, so removing a mapping requires an INVEPT. INVEPT only flushes the
+// physical CPU that executes it, and any physical CPU that ran one of the
+// domain's vCPUs might have the mapping cached. Instead, removing a mapping
+// bumps the EPT generation, and each physical CPU executes a global INVEPT
+// on its next VM entry if its generation is out of date (see
+// vcpu::flush_stale_translations). Unmapping is rare, so a single
+// generation is used for all domains.
+//
+// A vCPU that is executing on another physical CPU keeps its cached
+// translations until it exits, so once the generation has been bumped, the
+// mapping is only really gone if none of the domain's vCPUs are running.
+// The running count is checked after the bump, and a vCPU is counted before
+// it checks the generation, so either the vCPU sees the new generation on
+// its next VM entry, or we see the vCPU and fail, in which case the caller
+// must not reuse the memory.
+//
+
+std::atomic<uint64_t> g_ept_generation{};
+
+uint64_t
+domain::ept_generation() noexcept
+{ return g_ept_generation.load(); }
+
+void
+domain::set_vcpu_running(bool running) noexcept
+{
+    if (running) {
+        m_running_vcpus.fetch_add(1);
+    }
+    else {
+        m_running_vcpus.fetch_sub(1);
+    }
+}
+
 void
 domain::unmap(uintptr_t gpa)
-{ m_ept_map.unmap(gpa); }
+{
+    m_ept_map.unmap(gpa);
+    g_ept_generation.fetch_add(1);
+
+    if (m_running_vcpus.load() != 0) {
+        throw std::runtime_error("domain::unmap: domain's vCPUs are running");
+    }
+}
 
 void
 domain::release(uintptr_t gpa)
-{ m_ept_map.release(gpa); }
+{
+    m_ept_map.release(gpa);
+    g_ept_generation.fetch_add(1);
+
+    if (m_running_vcpus.load() != 0) {
+        throw std::runtime_error("domain::release: domain's vCPUs are running");
+    }
+}
 
 void
 domain::set_uart(uart::port_type uart) noexcept
@@ -173,6 +225,104 @@ domain::dump_uart(const gsl::span<char> &buffer)
     return 0;
 }
 
+void
+domain::set_uart_ring(bfvmm::x64::unique_map<boxy_uart_ring> &&ring)
+{
+    switch (m_uart_port) {
+        case 0x3F8: return m_uart_3F8.set_ring(std::move(ring));
+        case 0x2F8: return m_uart_2F8.set_ring(std::move(ring));
+        case 0x3E8: return m_uart_3E8.set_ring(std::move(ring));
+        case 0x2E8: return m_uart_2E8.set_ring(std::move(ring));
+
+        default:
+            break;
+    };
+}
+
+uint64_t
+domain::write_uart(const gsl::span<const char> &buffer)
+{
+    switch (m_uart_port) {
+        case 0x3F8: return m_uart_3F8.receive(buffer);
+        case 0x2F8: return m_uart_2F8.receive(buffer);
+        case 0x3E8: return m_uart_3E8.receive(buffer);
+        case 0x2E8: return m_uart_2E8.receive(buffer);
+
+        default:
+            break;
+    };
+
+    return 0;
+}
+
+bool
+domain::uart_irq_pending() const noexcept
+{
+    switch (m_uart_port) {
+        case 0x3F8: return m_uart_3F8.irq_pending();
+        case 0x2F8: return m_uart_2F8.irq_pending();
+        case 0x3E8: return m_uart_3E8.irq_pending();
+        case 0x2E8: return m_uart_2E8.irq_pending();
+
+        default:
+            break;
+    };
+
+    return false;
+}
+
+uint64_t
+domain::dump_uart(uint64_t handle)
+{
+    std::lock_guard lock(m_buffers_mutex);
+
+    auto iter = m_buffers.find(handle);
+    if (iter == m_buffers.end() || iter->second.size < UART_MAX_BUFFER) {
+        return FAILURE;
+    }
+
+    auto &buf = iter->second;
+    return this->dump_uart(
+        gsl::span<char>(buf.map.get(), static_cast<std::ptrdiff_t>(buf.size)));
+}
+
+uint64_t
+domain::register_buffer(bfvmm::x64::unique_map<char> &&map, uint64_t size)
+{
+    std::lock_guard lock(m_buffers_mutex);
+
+    if (m_buffers.size() >= BOXY_MAX_BUFFERS) {
+        return INVALID_BUFFER;
+    }
+
+    auto handle = m_next_buffer_handle++;
+    m_buffers.emplace(handle, registered_buffer{std::move(map), size});
+
+    return handle;
+}
+
+bool
+domain::unregister_buffer(uint64_t handle)
+{
+    std::lock_guard lock(m_buffers_mutex);
+    return m_buffers.erase(handle) != 0;
+}
+
+void
+domain::set_cpu_quota(uint64_t quota, uint64_t period) noexcept
+{
+    m_cpu_quota = quota;
+    m_cpu_period = period;
+}
+
+uint64_t
+domain::cpu_quota() const noexcept
+{ return m_cpu_quota; }
+
+uint64_t
+domain::cpu_period() const noexcept
+{ return m_cpu_period; }
+
 #define domain_reg(reg)                                                         \
     uint64_t                                                                    \
     domain::reg() const noexcept                                                \
@@ -24,6 +24,16 @@
 
 #include <iostream>
 
+// Note:
+//
+// The LAPIC timer is clocked by the TSC (i.e. the APIC bus frequency is
+// reported as the TSC frequency), which means that the initial count is
+// simply converted to TSC ticks using the divide configuration register.
+//
+
+constexpr const auto lvt_timer_mode_periodic = 1ULL;
+constexpr const auto lvt_timer_mode_tsc_deadline = 2ULL;
+
 #define EMULATE_MSR(a,r,w)                                                     \
     m_vcpu->emulate_rdmsr(a, {&x2apic_handler::r, this});                      \
     m_vcpu->emulate_wrmsr(a, {&x2apic_handler::w, this});
@@ -47,6 +57,7 @@ x2apic_handler::x2apic_handler(
     }
 
     EMULATE_MSR(0x0000001B, handle_rdmsr_0x0000001B, handle_wrmsr_0x0000001B);
+    EMULATE_MSR(0x000006E0, handle_rdmsr_0x000006E0, handle_wrmsr_0x000006E0);
 
     EMULATE_MSR(0x00000802, handle_rdmsr_0x00000802, handle_wrmsr_0x00000802);
     EMULATE_MSR(0x00000803, handle_rdmsr_0x00000803, handle_wrmsr_0x00000803);
@@ -72,9 +83,14 @@ x2apic_handler::x2apic_handler(
     EMULATE_MSR(0x00000826, handle_rdmsr_0x00000826, handle_wrmsr_0x00000826);
     EMULATE_MSR(0x00000827, handle_rdmsr_0x00000827, handle_wrmsr_0x00000827);
 
+    EMULATE_MSR(0x00000832, handle_rdmsr_0x00000832, handle_wrmsr_0x00000832);
     EMULATE_MSR(0x00000835, handle_rdmsr_0x00000835, handle_wrmsr_0x00000835);
     EMULATE_MSR(0x00000836, handle_rdmsr_0x00000836, handle_wrmsr_0x00000836);
     EMULATE_MSR(0x00000837, handle_rdmsr_0x00000837, handle_wrmsr_0x00000837);
+
+    EMULATE_MSR(0x00000838, handle_rdmsr_0x00000838, handle_wrmsr_0x00000838);
+    EMULATE_MSR(0x00000839, handle_rdmsr_0x00000839, handle_wrmsr_0x00000839);
+    EMULATE_MSR(0x0000083E, handle_rdmsr_0x0000083E, handle_wrmsr_0x0000083E);
 }
 
 // -----------------------------------------------------------------------------
@@ -103,6 +119,35 @@ x2apic_handler::handle_wrmsr_0x0000001B(
     return true;
 }
 
+bool
+x2apic_handler::handle_rdmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (this->timer_mode() != lvt_timer_mode_tsc_deadline) {
+        info.val = 0;
+        return true;
+    }
+
+    info.val = m_vcpu->lapic_timer_deadline();
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x000006E0(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (this->timer_mode() != lvt_timer_mode_tsc_deadline) {
+        return true;
+    }
+
+    m_vcpu->set_lapic_timer(m_0x00000832, info.val, 0);
+    return true;
+}
+
 // -----------------------------------------------------------------------------
 // General Purpose Registers
 // -----------------------------------------------------------------------------
@@ -540,6 +585,45 @@ x2apic_handler::handle_wrmsr_0x00000827(
 // LVT
 // -----------------------------------------------------------------------------
 
+bool
+x2apic_handler::handle_rdmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000832 & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000832(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    auto mode = this->timer_mode();
+    m_0x00000832 = info.val & 0x000700FF;
+
+    // Note:
+    //
+    // Changing the timer mode disarms the timer. Otherwise, the timer is
+    // left armed with the new vector and mask.
+    //
+
+    if (this->timer_mode() != mode) {
+        m_0x00000838 = 0;
+        m_vcpu->set_lapic_timer(m_0x00000832, 0, 0);
+
+        return true;
+    }
+
+    auto period =
+        this->timer_mode() == lvt_timer_mode_periodic ? this->timer_initial_tsc() : 0;
+
+    m_vcpu->set_lapic_timer(m_0x00000832, m_vcpu->lapic_timer_deadline(), period);
+    return true;
+}
+
 bool
 x2apic_handler::handle_rdmsr_0x00000835(
     vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
@@ -604,4 +688,112 @@ x2apic_handler::handle_wrmsr_0x00000837(
     return true;
 }
 
+// -----------------------------------------------------------------------------
+// Timer
+// -----------------------------------------------------------------------------
+
+bool
+x2apic_handler::handle_rdmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x00000838 & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000838(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    if (this->timer_mode() == lvt_timer_mode_tsc_deadline) {
+        return true;
+    }
+
+    m_0x00000838 = info.val & 0xFFFFFFFF;
+
+    if (m_0x00000838 == 0) {
+        m_vcpu->set_lapic_timer(m_0x00000832, 0, 0);
+        return true;
+    }
+
+    auto ticks = this->timer_initial_tsc();
+    auto period = this->timer_mode() == lvt_timer_mode_periodic ? ticks : 0;
+
+    m_vcpu->set_lapic_timer(m_0x00000832, ::x64::tsc::get() + ticks, period);
+    return true;
+}
+
+bool
+x2apic_handler::handle_rdmsr_0x00000839(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = 0;
+
+    if (this->timer_mode() == lvt_timer_mode_tsc_deadline) {
+        return true;
+    }
+
+    if (auto deadline = m_vcpu->lapic_timer_deadline(); deadline != 0) {
+        if (auto tsc = ::x64::tsc::get(); tsc < deadline) {
+            info.val = ((deadline - tsc) >> this->timer_divide_shift()) & 0xFFFFFFFF;
+        }
+    }
+
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x00000839(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(info);
+
+    vcpu->halt("writing to the APIC timer current count is unsupported");
+    return true;
+}
+
+bool
+x2apic_handler::handle_rdmsr_0x0000083E(
+    vcpu_t *vcpu, bfvmm::intel_x64::rdmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    info.val = m_0x0000083E & 0xFFFFFFFF;
+    return true;
+}
+
+bool
+x2apic_handler::handle_wrmsr_0x0000083E(
+    vcpu_t *vcpu, bfvmm::intel_x64::wrmsr_handler::info_t &info)
+{
+    bfignored(vcpu);
+
+    m_0x0000083E = info.val & 0x0000000B;
+    return true;
+}
+
+// -----------------------------------------------------------------------------
+// Private Helpers
+// -----------------------------------------------------------------------------
+
+uint64_t
+x2apic_handler::timer_mode() const noexcept
+{ return (m_0x00000832 >> 17U) & 0x3U; }
+
+uint64_t
+x2apic_handler::timer_divide_shift() const noexcept
+{
+    auto val = ((m_0x0000083E & 0x8U) >> 1U) | (m_0x0000083E & 0x3U);
+    return val == 0x7U ? 0 : val + 1;
+}
+
+uint64_t
+x2apic_handler::timer_initial_tsc() const noexcept
+{ return m_0x00000838 << this->timer_divide_shift(); }
+
 }
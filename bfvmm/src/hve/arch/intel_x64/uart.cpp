@@ -24,8 +24,23 @@
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/uart.h>
 
+#include <algorithm>
 #include <iostream>
 
+//--------------------------------------------------------------------------
+// Definitions
+//--------------------------------------------------------------------------
+
+constexpr uint8_t ier_rx_data_available = 0x01;
+constexpr uint8_t ier_tx_holding_empty = 0x02;
+
+constexpr uint8_t iir_none = 0x01;
+constexpr uint8_t iir_tx_holding_empty = 0x02;
+constexpr uint8_t iir_rx_data_available = 0x04;
+
+constexpr uint8_t lsr_data_ready = 0x01;
+constexpr uint8_t lsr_tx_empty = 0x60;
+
 //--------------------------------------------------------------------------
 // Implementation
 //--------------------------------------------------------------------------
@@ -58,9 +73,13 @@ uart::enable(gsl::not_null<vcpu *> vcpu)
     EMULATE_IO_INSTRUCTION(m_port + 6, reg6_in_handler, reg6_out_handler);
     EMULATE_IO_INSTRUCTION(m_port + 7, reg7_in_handler, reg7_out_handler);
 
-    // vcpu->add_vmcall_handler(
-    //     vmcall_handler_delegate(uart, vmcall_dispatch)
-    // );
+    vcpu->add_fast_vmcall_handler(
+        hypercall_enum_uart_op, {&uart::vmcall_dispatch, this}
+    );
+
+    vcpu->add_resume_delegate(
+        {&uart::resume_delegate, this}
+    );
 }
 
 void
@@ -123,6 +142,62 @@ uart::dump(const gsl::span<char> &buffer)
     return i;
 }
 
+void
+uart::set_ring(bfvmm::x64::unique_map<boxy_uart_ring> &&ring)
+{
+    std::lock_guard lock(m_mutex);
+    m_ring = std::move(ring);
+
+    if (m_ring.get() == nullptr) {
+        return;
+    }
+
+    this->write_ring(m_buffer.data(), m_index);
+    m_index = 0;
+}
+
+uint64_t
+uart::receive(const gsl::span<const char> &buffer)
+{
+    std::lock_guard lock(m_mutex);
+
+    auto space = m_rx_buffer.size() - (m_rx_tail - m_rx_head);
+    auto bytes = std::min<uint64_t>(space, static_cast<uint64_t>(buffer.size()));
+
+    for (uint64_t i = 0; i < bytes; i++) {
+        m_rx_buffer.at(m_rx_tail++ % m_rx_buffer.size()) =
+            buffer.at(static_cast<std::ptrdiff_t>(i));
+    }
+
+    this->update_irq();
+    return bytes;
+}
+
+bool
+uart::irq_pending() const noexcept
+{ return __atomic_load_n(&m_irq_pending, __ATOMIC_ACQUIRE); }
+
+void
+uart::resume_delegate(vcpu_t *vcpu)
+{
+    // Note:
+    //
+    // Input is received (and the transmitter is emptied) while dom0 or
+    // another vCPU is executing, so the vIRQ cannot be queued right away.
+    // Instead, it is marked pending and delivered by the first of the
+    // guest's vCPUs to be resumed. bfexec kicks its vCPU thread after
+    // writing input, so this happens right away.
+    //
+
+    if (!__atomic_load_n(&m_irq_pending, __ATOMIC_RELAXED)) {
+        return;
+    }
+
+    if (__atomic_exchange_n(&m_irq_pending, false, __ATOMIC_ACQ_REL)) {
+        _v(vcpu)->queue_virtual_interrupt(boxy_virq__uart_event_handler);
+    }
+}
+
 bool
 uart::io_zero_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
@@ -155,6 +230,11 @@ uart::reg0_in_handler(
     }
     else {
         info.val = 0x0;
+
+        if (this->rx_ready()) {
+            info.val = static_cast<uint8_t>(
+                m_rx_buffer.at(m_rx_head++ % m_rx_buffer.size()));
+        }
     }
 
     return true;
@@ -171,7 +251,7 @@ uart::reg1_in_handler(
         info.val = m_baud_rate_h;
     }
     else {
-        info.val = 0x0;
+        info.val = m_interrupt_enable_register;
     }
 
     return true;
@@ -182,10 +262,28 @@ uart::reg2_in_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
     bfignored(vcpu);
+    std::lock_guard lock(m_mutex);
 
-    info.val = 0x0;
-    bfalert_info(1, "uart: reg2 read not supported");
+    // Note:
+    //
+    // Like a real 16550, the transmitter holding register empty interrupt
+    // is cleared by reading the IIR (when it is the interrupt reported),
+    // while the received data interrupt is cleared by reading the data.
+    //
+
+    if ((m_interrupt_enable_register & ier_rx_data_available) != 0 && this->rx_ready()) {
+        info.val = iir_rx_data_available;
+        return true;
+    }
+
+    if ((m_interrupt_enable_register & ier_tx_holding_empty) != 0 && m_thre_pending) {
+        info.val = iir_tx_holding_empty;
+        m_thre_pending = false;
 
+        return true;
+    }
+
+    info.val = iir_none;
     return true;
 }
 
@@ -217,8 +315,14 @@ uart::reg5_in_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
     bfignored(vcpu);
+    std::lock_guard lock(m_mutex);
+
+    info.val = lsr_tx_empty;
+
+    if (this->rx_ready()) {
+        info.val |= lsr_data_ready;
+    }
 
-    info.val = 0x60;
     return true;
 }
 
@@ -250,15 +354,36 @@ bool
 uart::reg0_out_handler(
     vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info)
 {
-    bfignored(vcpu);
+    // Note:
+    //
+    // Mapping the string of a REP OUTS walks the guest's page tables and
+    // maps its memory into the VMM, which is why it is done before the lock
+    // is acquired. Only the vCPU's own registers are touched until then.
+    //
+
+    bfvmm::x64::unique_map<char> str{};
+    uint64_t len{};
+
+    auto rep = this->rep_outs_handler(vcpu, info, str, len);
+
     std::lock_guard lock(m_mutex);
 
     if (this->dlab()) {
         m_baud_rate_l = gsl::narrow<data_type>(info.val);
+        return true;
     }
-    else {
+
+    if (!rep) {
         this->write(gsl::narrow<char>(info.val));
     }
+    else if (len != 0) {
+        this->write(str.get(), len);
+    }
+
+    if ((m_interrupt_enable_register & ier_tx_holding_empty) != 0) {
+        m_thre_pending = true;
+        this->update_irq();
+    }
 
     return true;
 }
@@ -272,13 +397,25 @@ uart::reg1_out_handler(
 
     if (this->dlab()) {
         m_baud_rate_h = gsl::narrow<data_type>(info.val);
+        return true;
     }
-    else {
-        if (info.val != 0) {
-            bfalert_info(1, "uart: none-zero write to reg1 unsupported");
-        }
+
+    auto ier = gsl::narrow<data_type>(info.val & 0x0F);
+
+    // Note:
+    //
+    // The transmitter is always empty, so enabling the transmitter holding
+    // register empty interrupt raises it right away (like a real 16550).
+    //
+
+    if ((ier & ier_tx_holding_empty) != 0 &&
+        (m_interrupt_enable_register & ier_tx_holding_empty) == 0) {
+        m_thre_pending = true;
     }
 
+    m_interrupt_enable_register = ier;
+    this->update_irq();
+
     return true;
 }
 
@@ -346,22 +483,172 @@ uart::reg7_out_handler(
     return true;
 }
 
+bool
+uart::rep_outs_handler(
+    vcpu_t *vcpu, bfvmm::intel_x64::io_instruction_handler::info_t &info,
+    bfvmm::x64::unique_map<char> &str, uint64_t &len)
+{
+    namespace io_instruction = vmcs_n::exit_qualification::io_instruction;
+
+    // Note:
+    //
+    // A REP OUTSB to the data port would otherwise exit once per byte. Instead,
+    // the string is mapped from the guest so that it can be written in one
+    // shot, and RSI and RCX are updated as if the instruction had completed.
+    // Anything other than a forward, byte sized REP OUTS is handled one
+    // element at a time by the caller. The string is only mapped up to the
+    // end of the page it starts in (as the next page might not be physically
+    // contiguous), and up to UART_MAX_BUFFER bytes, in which case RIP is not
+    // advanced so that the guest exits again for the rest.
+    //
+
+    auto eq = io_instruction::get();
+
+    if (io_instruction::string_instruction::is_disabled(eq) ||
+        io_instruction::rep_prefixed::is_disabled(eq) ||
+        io_instruction::size_of_access::get(eq) != io_instruction::size_of_access::one_byte ||
+        vmcs_n::guest_rflags::direction_flag::is_enabled()) {
+        return false;
+    }
+
+    // Note:
+    //
+    // The instruction only uses as much of RCX and RSI as its address size
+    // allows (bits 9:7 of the VM-exit instruction information), and a 16bit
+    // or 32bit RSI wraps instead of crossing into the bits above it. Like
+    // the hardware, a 32bit update clears the upper 32 bits, and a 16bit
+    // update leaves the upper bits alone.
+    //
+
+    auto address_size = (vmcs_n::vm_exit_instruction_information::get() >> 7) & 0x7U;
+
+    auto mask = ~0ULL;
+    switch (address_size) {
+        case 0: mask = 0xFFFFULL; break;
+        case 1: mask = 0xFFFFFFFFULL; break;
+        default: break;
+    };
+
+    auto update = [mask](uint64_t reg, uint64_t val) {
+        if (mask == 0xFFFFULL) {
+            return (reg & ~mask) | (val & mask);
+        }
+
+        return val & mask;
+    };
+
+    auto count = vcpu->rcx() & mask;
+    auto rsi = vcpu->rsi() & mask;
+
+    len = 0;
+    if (count == 0) {
+        return true;
+    }
+
+    auto gva = vmcs_n::guest_linear_address::get();
+
+    len = std::min<uint64_t>(count, UART_MAX_BUFFER);
+    len = std::min<uint64_t>(len, BAREFLANK_PAGE_SIZE - (gva & (BAREFLANK_PAGE_SIZE - 1)));
+
+    if (mask != ~0ULL) {
+        len = std::min<uint64_t>(len, mask - rsi + 1);
+    }
+
+    str = vcpu->map_gva_4k<char>(gva, len);
+
+    vcpu->set_rsi(update(vcpu->rsi(), rsi + len));
+    vcpu->set_rcx(update(vcpu->rcx(), count - len));
+
+    if (count != len) {
+        info.ignore_advance = true;
+    }
+
+    return true;
+}
+
+void
+uart::update_irq()
+{
+    auto rx = (m_interrupt_enable_register & ier_rx_data_available) != 0 && this->rx_ready();
+    auto tx = (m_interrupt_enable_register & ier_tx_holding_empty) != 0 && m_thre_pending;
+
+    if (rx || tx) {
+        __atomic_store_n(&m_irq_pending, true, __ATOMIC_RELEASE);
+    }
+}
+
 void
 uart::write(const char c)
+{ this->write(&c, 1); }
+
+void
+uart::write(const char *buf, std::size_t len)
 {
-    if (m_index < m_buffer.size()) {
-        m_buffer.at(m_index++) = c;
+    if (m_ring.get() != nullptr) {
+        this->write_ring(buf, len);
+        return;
     }
+
+    len = std::min(len, m_buffer.size() - m_index);
+    if (len == 0) {
+        return;
+    }
+
+    std::copy_n(buf, len, &m_buffer.at(m_index));
+    m_index += len;
 }
 
 void
-uart::write(const char *str)
+uart::write_ring(const char *buf, std::size_t len)
 {
-    for (auto i = 0U; i < strlen(str); i++) {
-        this->write(str[i]);
+    auto ring = m_ring.get();
+
+    // Note:
+    //
+    // The ring lives in dom0's memory, so nothing in it can be trusted. The
+    // VMM is the only producer, so prod is always read back from the ring
+    // but only cons is loaded with acquire (to see the consumer's progress).
+    // The index is always masked, so a corrupt prod or cons can only lose
+    // output, never write outside of the ring.
+    //
+
+    auto prod = ring->prod;
+    auto cons = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+
+    auto used = prod - cons;
+    auto space = used < BOXY_UART_RING_SIZE ? BOXY_UART_RING_SIZE - used : 0;
+
+    if (len > space) {
+        ring->dropped += len - space;
+        len = space;
     }
+
+    // Note:
+    //
+    // The output might wrap around the end of the ring, in which case it is
+    // copied in two pieces. prod is only published once all of the output
+    // has been copied, so the consumer never sees a partial write.
+    //
+
+    while (len > 0) {
+        auto index = prod & (BOXY_UART_RING_SIZE - 1);
+        auto bytes = std::min<uint64_t>(len, BOXY_UART_RING_SIZE - index);
+
+        std::copy_n(buf, bytes, &ring->data[index]);
+
+        buf += bytes;
+        len -= bytes;
+        prod += bytes;
+    }
+
+    __atomic_store_n(&ring->prod, prod, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->doorbell, 1, __ATOMIC_RELEASE);
 }
 
+void
+uart::write(const char *str)
+{ this->write(str, strlen(str)); }
+
 bool
 uart::vmcall_dispatch(vcpu *vcpu)
 {
@@ -369,10 +656,25 @@ uart::vmcall_dispatch(vcpu *vcpu)
         return false;
     }
 
+    if (vcpu->rax() == hypercall_enum_uart_op__write) {
+        this->uart_op__write(vcpu);
+        return true;
+    }
+
+    // Note:
+    //
+    // This is the only handler for uart_op on this vCPU, so an op for a port
+    // that we do not own is failed here, the same way uart_op__write does,
+    // rather than being left unhandled (which would halt the vCPU).
+    //
+
     if (vcpu->rcx() != m_port) {
-        return false;
+        vcpu->set_rax(FAILURE);
+        return true;
     }
 
+    std::lock_guard lock(m_mutex);
+
     switch (vcpu->rbx()) {
         case hypercall_enum_uart_op__char:
             this->write(gsl::narrow_cast<char>(vcpu->rdx()));
@@ -393,4 +695,31 @@ uart::vmcall_dispatch(vcpu *vcpu)
     return true;
 }
 
+void
+uart::uart_op__write(vcpu *vcpu)
+{
+    if (vcpu->rbx() != m_port) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    auto len = std::min<uint64_t>(vcpu->rdx(), UART_MAX_BUFFER);
+    if (len == 0) {
+        vcpu->set_rax(0);
+        return;
+    }
+
+    try {
+        auto buf = vcpu->map_gva_4k<char>(vcpu->rcx(), len);
+
+        std::lock_guard lock(m_mutex);
+        this->write(buf.get(), len);
+
+        vcpu->set_rax(len);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
 }
+
+}
\ No newline at end of file
@@ -20,6 +20,9 @@
 // SOFTWARE.
 
 #include <set>
+#include <mutex>
+#include <atomic>
+#include <vector>
 #include <intrinsics.h>
 
 #include <bfgpalayout.h>
@@ -78,6 +81,108 @@ namespace boxy::intel_x64
 //
 std::set<vcpu *> g_domU_vcpus{};
 
+// Note:
+//
+// Returns the physical address of the VMCS that is current on this physical
+// CPU (i.e. VMPTRST), which is all 1s if no VMCS is current (e.g. after a
+// VMCLEAR of the current VMCS, or once the hypervisor is restarted). Unlike
+// tracking the VMCS that we loaded last, this cannot get out of sync with
+// the hardware, no matter who loads or clears a VMCS, and a VMPTRST is much
+// cheaper than the VMPTRLD it saves.
+//
+static uintptr_t
+current_vmcs() noexcept
+{
+    uintptr_t phys{};
+    __asm__ __volatile__ ("vmptrst %0" : "=m"(phys) : : "memory");
+
+    return phys;
+}
+
+//------------------------------------------------------------------------------
+// VPID Allocation
+//------------------------------------------------------------------------------
+
+// Note:
+//
+// VPID 0 is reserved for VMX root (i.e. the VMM), and VPID 1 is shared by
+// all of the dom0 vCPUs. Sharing a VPID between dom0 vCPUs is safe as there
+// is only one dom0 vCPU per physical CPU, and TLBs are per physical CPU.
+// All of the domU vCPUs get a VPID of their own, and VPIDs are recycled when
+// a domU vCPU is destroyed.
+//
+// INVVPID only flushes the physical CPU that executes it, and the previous
+// owner of a recycled VPID (or the vCPU itself, before it migrated) might
+// have left translations in the TLB of any physical CPU it ran on. Instead
+// of flushing when a VPID is allocated or released, a domU vCPU remembers
+// the physical CPU it last ran on, and flushes its VPID on the first entry
+// after it moves to a different physical CPU, which includes the first
+// entry of a vCPU that was just given a recycled VPID (see
+// flush_stale_translations).
+//
+
+constexpr uint16_t dom0_vpid = 1;
+
+std::mutex g_vpid_mutex{};
+uint32_t g_vpid_next{dom0_vpid + 1};
+std::vector<uint16_t> g_vpid_free{};
+
+static uint16_t
+allocate_vpid()
+{
+    std::lock_guard lock(g_vpid_mutex);
+
+    if (!g_vpid_free.empty()) {
+        auto vpid = g_vpid_free.back();
+        g_vpid_free.pop_back();
+
+        return vpid;
+    }
+
+    if (g_vpid_next > 0xFFFF) {
+        throw std::runtime_error("out of VPIDs");
+    }
+
+    return gsl::narrow_cast<uint16_t>(g_vpid_next++);
+}
+
+static void
+release_vpid(uint16_t vpid)
+{
+    std::lock_guard lock(g_vpid_mutex);
+    g_vpid_free.push_back(vpid);
+}
+
+//------------------------------------------------------------------------------
+// Physical CPU Tracking
+//------------------------------------------------------------------------------
+
+// Note:
+//
+// Each physical CPU is given a tag (the first time it is asked for one),
+// which is what a vCPU uses to remember the physical CPU it last ran on.
+// Tags are never reused, and 0 is never a valid tag, so a vCPU that has
+// not run yet never matches the physical CPU it is about to run on.
+//
+// The EPT generation of each physical CPU is the domain's EPT generation
+// (see domain::ept_generation) as of the last time the physical CPU flushed
+// its EPT derived translations.
+//
+
+std::atomic<uint64_t> g_next_cpu_tag{1};
+thread_local uint64_t t_cpu_tag{};
+thread_local uint64_t t_ept_generation{};
+
+static uint64_t
+cpu_tag() noexcept
+{
+    if (t_cpu_tag == 0) {
+        t_cpu_tag = g_next_cpu_tag.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    return t_cpu_tag;
+}
+
 vcpu::vcpu(
     vcpuid::type id,
     gsl::not_null<domain *> domain
@@ -101,9 +206,23 @@ vcpu::vcpu(
     m_x2apic_handler{this},
 
     m_vclock_handler{this},
-    m_virq_handler{this}
+    m_virq_handler{this},
+    m_quota_handler{this}
 {
+    // Note:
+    //
+    // The base vCPU loads its VMCS when it is created. We load it again here
+    // (no matter what the base vCPU does) so that we can record the address
+    // of our VMCS, which is what load() compares with the current VMCS.
+    //
+
+    bfvmm::intel_x64::vcpu::load();
+    m_vmcs_phys = current_vmcs();
+
     this->set_eptp(domain->ept());
+    this->setup_vpid();
+
+    this->add_resume_delegate({&vcpu::flush_stale_translations, this});
 
     if (this->is_dom0()) {
         this->write_dom0_guest_state(domain);
@@ -116,11 +235,26 @@ vcpu::vcpu(
 
 vcpu::~vcpu()
 {
+    // Note:
+    //
+    // The dom0 vCPUs are destroyed (on their own physical CPU) when the
+    // hypervisor is stopped, after which the host might change any MSR.
+    //
+
+    if (this->is_dom0()) {
+        msr_handler::isolate_msr__reset();
+    }
+
+    if (m_vpid > dom0_vpid) {
+        release_vpid(m_vpid);
+    }
+
     if (this->is_bootstrap_vcpu()) {
         for (const auto &vcpu : g_domU_vcpus) {
             vcpu->clear();
-            vcpu->reset_host_wallclock();
         }
+
+        this->reset_host_wallclock();
     }
 }
 
@@ -140,13 +274,63 @@ domain::domainid_type
 vcpu::domid() const noexcept
 { return m_domain->id(); }
 
+domain *
+vcpu::dom() const noexcept
+{ return m_domain; }
+
+//------------------------------------------------------------------------------
+// VMCS
+//------------------------------------------------------------------------------
+
+void
+vcpu::load()
+{
+    if (current_vmcs() == m_vmcs_phys) {
+        return;
+    }
+
+    bfvmm::intel_x64::vcpu::load();
+}
+
+void
+vcpu::flush_stale_translations(vcpu_t *vcpu)
+{
+    bfignored(vcpu);
+
+    // Note:
+    //
+    // This runs on every VM entry, so it only ever looks at data owned by
+    // this physical CPU, except for the EPT generation, which is a single
+    // atomic load.
+    //
+
+    auto generation = domain::ept_generation();
+    if (t_ept_generation != generation) {
+        ::intel_x64::vmx::invept_global();
+        t_ept_generation = generation;
+    }
+
+    if (m_vpid > dom0_vpid) {
+        if (auto tag = cpu_tag(); m_last_cpu_tag != tag) {
+            ::intel_x64::vmx::invvpid_single_context(m_vpid);
+            m_last_cpu_tag = tag;
+        }
+    }
+}
+
 //------------------------------------------------------------------------------
 // VMCall
 //------------------------------------------------------------------------------
 
 void
-vcpu::add_vmcall_handler(const handler_delegate_t &d)
-{ m_vmcall_handler.add_handler(std::move(d)); }
+vcpu::add_vmcall_handler(
+    uint64_t opcode, const handler_delegate_t &d)
+{ m_vmcall_handler.add_handler(opcode, d); }
+
+void
+vcpu::add_fast_vmcall_handler(
+    uint64_t opcode, const handler_delegate_t &d)
+{ m_vmcall_handler.add_fast_handler(opcode, d); }
 
 //------------------------------------------------------------------------------
 // Hlt
@@ -187,6 +371,8 @@ vcpu::prepare_for_world_switch()
 void
 vcpu::return_fault(uint64_t error)
 {
+    m_run_op_handler.set_child_runstate(BOXY_RUNSTATE_BLOCKED);
+
     this->set_rax((error << 4) | hypercall_enum_run_op__fault);
     this->prepare_for_world_switch();
     this->run();
@@ -195,15 +381,19 @@ vcpu::return_fault(uint64_t error)
 void
 vcpu::return_continue()
 {
+    m_run_op_handler.set_child_runstate(BOXY_RUNSTATE_RUNNABLE);
+
     this->set_rax(hypercall_enum_run_op__continue);
     this->prepare_for_world_switch();
     this->run();
 }
 
 void
-vcpu::return_yield(uint64_t nsec)
+vcpu::return_yield(uint64_t tsc)
 {
-    this->set_rax((nsec << 4) | hypercall_enum_run_op__yield);
+    m_run_op_handler.set_child_runstate(BOXY_RUNSTATE_BLOCKED);
+
+    this->set_rax((tsc << 4) | hypercall_enum_run_op__yield);
     this->prepare_for_world_switch();
     this->run();
 }
@@ -211,6 +401,8 @@ vcpu::return_yield(uint64_t nsec)
 void
 vcpu::return_set_wallclock()
 {
+    m_run_op_handler.set_child_runstate(BOXY_RUNSTATE_RUNNABLE);
+
     this->set_rax(hypercall_enum_run_op__set_wallclock);
     this->prepare_for_world_switch();
     this->run();
@@ -232,6 +424,50 @@ bool
 vcpu::is_killed() const noexcept
 { return m_killed; }
 
+//------------------------------------------------------------------------------
+// Run State
+//------------------------------------------------------------------------------
+
+void
+vcpu::set_runstate(uint64_t state) noexcept
+{
+    auto tsc = ::x64::tsc::get();
+    auto was_running = m_runstate.state == BOXY_RUNSTATE_RUNNING;
+
+    if (m_runstate.state_entry_time != 0) {
+        m_runstate.time[m_runstate.state] += tsc - m_runstate.state_entry_time;
+    }
+    else {
+        was_running = false;
+    }
+
+    if (was_running != (state == BOXY_RUNSTATE_RUNNING)) {
+        m_domain->set_vcpu_running(!was_running);
+    }
+
+    m_runstate.state = state;
+    m_runstate.state_entry_time = tsc;
+
+    m_vclock_handler.update_steal_time(
+        m_runstate.time[BOXY_RUNSTATE_RUNNABLE], state == BOXY_RUNSTATE_RUNNABLE);
+}
+
+struct boxy_runstate_info
+vcpu::runstate() const noexcept
+{
+    auto info = m_runstate;
+
+    if (info.state_entry_time != 0) {
+        info.time[info.state] += ::x64::tsc::get() - info.state_entry_time;
+    }
+
+    return info;
+}
+
+uint64_t
+vcpu::quota_deadline() noexcept
+{ return m_quota_handler.deadline(); }
+
 //------------------------------------------------------------------------------
 // Virtual IRQs
 //------------------------------------------------------------------------------
@@ -244,17 +480,17 @@ void
 vcpu::inject_virtual_interrupt(uint64_t vector)
 { m_virq_handler.inject_virtual_interrupt(vector); }
 
+bool
+vcpu::has_pending_virtual_interrupts() const noexcept
+{ return m_virq_handler.has_pending_virtual_interrupts(); }
+
 //------------------------------------------------------------------------------
 // Virtual Clock
 //------------------------------------------------------------------------------
 
 void
-vcpu::set_host_wallclock_rtc(uint64_t sec, uint64_t nsec) noexcept
-{ m_vclock_handler.set_host_wallclock_rtc(sec, nsec); }
-
-void
-vcpu::set_host_wallclock_tsc(uint64_t val) noexcept
-{ m_vclock_handler.set_host_wallclock_tsc(val); }
+vcpu::set_host_wallclock(uint64_t sec, uint64_t nsec, uint64_t tsc) noexcept
+{ m_vclock_handler.set_host_wallclock(sec, nsec, tsc); }
 
 void
 vcpu::reset_host_wallclock(void) noexcept
@@ -264,6 +500,15 @@ std::pair<struct timespec, uint64_t>
 vcpu::get_host_wallclock() const
 { return m_vclock_handler.get_host_wallclock(); }
 
+void
+vcpu::set_lapic_timer(
+    uint64_t lvt, uint64_t deadline, uint64_t period) noexcept
+{ m_vclock_handler.set_lapic_timer(lvt, deadline, period); }
+
+uint64_t
+vcpu::lapic_timer_deadline() const noexcept
+{ return m_vclock_handler.lapic_timer_deadline(); }
+
 //------------------------------------------------------------------------------
 // Fault
 //------------------------------------------------------------------------------
@@ -402,6 +647,27 @@ vcpu::setup_default_controls()
     enable_xsaves_xrstors::disable();
 }
 
+void
+vcpu::setup_vpid()
+{
+    using namespace vmcs_n;
+    using namespace secondary_processor_based_vm_execution_controls;
+
+    // Note:
+    //
+    // With a VPID of their own, the guest's translations remain in the TLB
+    // across the world switches that occur between dom0 and the domU
+    // (which happen on every host interrupt). Changes to the guest's CR3
+    // are handled by the hardware, and changes to the EPT and migrations
+    // between physical CPUs are handled by flush_stale_translations.
+    //
+
+    m_vpid = this->is_dom0() ? dom0_vpid : allocate_vpid();
+
+    virtual_processor_identifier::set(m_vpid);
+    enable_vpid::enable();
+}
+
 void
 vcpu::setup_default_handlers()
 {
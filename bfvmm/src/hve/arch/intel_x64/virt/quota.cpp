@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2019 Assured Information Security, Inc.
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <hve/arch/intel_x64/vcpu.h>
+#include <hve/arch/intel_x64/virt/quota.h>
+
+// -----------------------------------------------------------------------------
+// Notes about CPU Quotas
+// -----------------------------------------------------------------------------
+
+// A domain can be given a CPU quota and period (both in TSC ticks), in which
+// case each of its vCPUs may only run for the quota in every period. The time
+// that a vCPU has run is taken from its run state (i.e. the time spent in
+// BOXY_RUNSTATE_RUNNING), so time spent yielded or preempted by the host is
+// not charged against the quota.
+//
+// The quota is enforced using the preemption timer, which is shared with
+// the vclock handler. On each VM entry, the vclock handler arms the
+// preemption timer for whichever comes first: its own events, or the
+// deadline returned by this handler. When the preemption timer fires, the
+// vclock handler gets the first chance to handle the exit and only returns
+// true if one of its events expired. Otherwise the exit is handled here, and
+// if the quota has been used up, the vCPU is yielded back to the parent
+// until the start of the next period.
+//
+
+// -----------------------------------------------------------------------------
+// Implementation
+// -----------------------------------------------------------------------------
+
+namespace boxy::intel_x64
+{
+
+quota_handler::quota_handler(
+    gsl::not_null<vcpu *> vcpu
+) :
+    m_vcpu{vcpu}
+{
+    if (vcpu->is_dom0()) {
+        return;
+    }
+
+    m_vcpu->add_preemption_timer_handler(
+        {&quota_handler::handle_preemption_timer, this}
+    );
+}
+
+uint64_t
+quota_handler::deadline() noexcept
+{
+    auto dom = m_vcpu->dom();
+
+    auto quota = dom->cpu_quota();
+    auto period = dom->cpu_period();
+
+    if (quota == 0 || period == 0) {
+        return 0;
+    }
+
+    auto tsc = ::x64::tsc::get();
+    auto running = m_vcpu->runstate().time[BOXY_RUNSTATE_RUNNING];
+
+    if (tsc - m_period_start_tsc >= period) {
+        m_period_start_tsc = tsc;
+        m_period_start_running_tsc = running;
+    }
+
+    auto used = running - m_period_start_running_tsc;
+    if (used >= quota) {
+        return tsc;
+    }
+
+    return tsc + (quota - used);
+}
+
+bool
+quota_handler::handle_preemption_timer(vcpu *vcpu)
+{
+    auto deadline = this->deadline();
+
+    if (deadline == 0 || ::x64::tsc::get() < deadline) {
+        return true;
+    }
+
+    vcpu->parent_vcpu()->load();
+    vcpu->parent_vcpu()->return_yield(
+        m_period_start_tsc + vcpu->dom()->cpu_period()
+    );
+
+    // Unreachable
+    return true;
+}
+
+}
@@ -19,12 +19,37 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+#include <mutex>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/virt/vclock.h>
 #include <bftsc.h>
 
 #define NSEC_PER_SEC 1000000000L
 
+// -----------------------------------------------------------------------------
+// Halt Polling
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// When a guest yields, instead of returning to bfexec (which costs a full
+// host context switch to wake up again), we first spin for a short period
+// of time waiting for an event (e.g. a vIRQ, or the guest's next timer).
+// The amount of time that we spin is tuned per vCPU (in the same way KVM
+// tunes halt_poll_ns): if the poll gives up, and the vCPU is woken up again
+// shortly after, a longer poll would have caught the wakeup, so the poll
+// grows. If the vCPU sleeps for longer than the max, the guest is truly
+// idle, and the poll shrinks. The max must be kept small as host
+// interrupts are not serviced on this CPU while we spin.
+//
+
+constexpr uint64_t halt_poll_min_nsec = 10000;
+constexpr uint64_t halt_poll_max_nsec = 50000;
+constexpr uint64_t halt_poll_grow = 2;
+constexpr uint64_t halt_poll_shrink = 2;
+
 // -----------------------------------------------------------------------------
 // Notes about Event Timer Injection
 // -----------------------------------------------------------------------------
@@ -53,6 +78,14 @@
 // guest OS to sort out.
 //
 
+// The same mechanism is used to emulate the LAPIC timer (TSC deadline, one-shot
+// and periodic modes) for guests that do not use the vclock. Both deadlines
+// are tracked separately and the preemption timer is set to whichever comes
+// first. When the LAPIC timer expires, the vector in the LVT timer register is
+// queued as an external interrupt, and the periodic mode is simply a deadline
+// that is moved forward by the period each time it expires.
+//
+
 // -----------------------------------------------------------------------------
 // Notes about TSC <-> Nanonsecond Conversions
 // -----------------------------------------------------------------------------
@@ -216,6 +249,21 @@
 //     software to the guest OS to recalculate the time (like a sync driver or
 //     something like NTP) to ensure that drift is handled.
 //
+//     With the above in mind, we no longer use the Quotient Remainder therom.
+//     The vClock page gives the guest a pvclock multiplier and shift, which
+//     means that the guest is already using scaling math. If the hypervisor
+//     uses the same multiplier and shift, the guest OS and the hypervisor
+//     still calculate time using the same equations (so they do not drift
+//     from each other), and the divides are removed from the timer paths.
+//     The multiplier and shift are calculated once when the vCPU is created,
+//     and the conversion is:
+//
+//     nsecs = ((TSC << shift) * mul) >> 32    (a negative shift is a >>)
+//
+//     To prevent the multiply from overflowing without the need for 128bit
+//     math, the multiply is split into the upper and lower 32bits of the
+//     shifted TSC (the same way Linux implements mul_u64_u32_shr).
+//
 //   Formula #2:
 //
 //   - nanoseconds = (tsc ticks * 1,000,000) / tsc_freq_khz
@@ -224,7 +272,8 @@
 //   - tsc ticks = (nanoseconds * tsc_freq_khz) / 1,000,000
 //
 //   The same issue above holds true with this equation. So we will use the
-//   same mul_div function to handle this math.
+//   same scaling math, with a second multiplier and shift that scales
+//   nanoseconds to TSC ticks instead.
 //
 //   Formula #3:
 //
@@ -241,8 +290,63 @@
 // -----------------------------------------------------------------------------
 
 static uint64_t
-mul_div(uint64_t x, uint64_t n, uint64_t d)
-{ return ((x / d) * n) + (((x % d) * n) / d); }
+mul_u64_u32_shr32(uint64_t a, uint32_t mul)
+{
+    auto al = a & 0xFFFFFFFFULL;
+    auto ah = a >> 32U;
+
+    return ((al * mul) >> 32U) + (ah * mul);
+}
+
+static uint64_t
+scale_delta(uint64_t delta, uint32_t mul, int8_t shift)
+{
+    if (shift < 0) {
+        delta >>= -shift;
+    }
+    else {
+        delta <<= shift;
+    }
+
+    return mul_u64_u32_shr32(delta, mul);
+}
+
+// Note:
+//
+// Calculates the multiplier and shift used by the pvclock ABI to convert a
+// TSC delta to nanoseconds (i.e. ((delta << shift) * mul) >> 32). This is
+// the same algorithm that KVM uses (kvm_get_time_scale) so that the results
+// match what a guest's pvclock driver expects.
+//
+
+static void
+pvclock_time_scale(
+    uint64_t scaled_hz, uint64_t base_hz, int8_t &shift, uint32_t &mul)
+{
+    int32_t s = 0;
+    uint64_t tps64 = base_hz;
+    uint64_t scaled64 = scaled_hz;
+
+    while (tps64 > scaled64 * 2 || (tps64 & 0xFFFFFFFF00000000ULL) != 0) {
+        tps64 >>= 1;
+        s--;
+    }
+
+    auto tps32 = gsl::narrow_cast<uint32_t>(tps64);
+    while (tps32 <= scaled64 || (scaled64 & 0xFFFFFFFF00000000ULL) != 0) {
+        if ((scaled64 & 0xFFFFFFFF00000000ULL) != 0 || (tps32 & 0x80000000U) != 0) {
+            scaled64 >>= 1;
+        }
+        else {
+            tps32 <<= 1;
+        }
+
+        s++;
+    }
+
+    shift = gsl::narrow_cast<int8_t>(s);
+    mul = gsl::narrow_cast<uint32_t>((scaled64 << 32) / tps32);
+}
 
 static struct timespec
 inc_timespec(const struct timespec &ts, uint64_t nsec)
@@ -269,6 +373,31 @@ sub_timespec(const struct timespec &ts1, const struct timespec &ts2)
     return {sec, nsec};
 }
 
+// -----------------------------------------------------------------------------
+// Host Wall Clock
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// There is only one host wall clock, which is shared by every vCPU in every
+// domain. It is set by dom0 (bfexec) and refreshed periodically, so that
+// when a guest asks for the host wall clock, it is usually already valid
+// and the guest does not have to return to bfexec to have it read. The RTC
+// and the TSC are always updated (and read) together under the lock so that
+// a guest can never see the RTC of one reference and the TSC of another.
+//
+// When the host suspends, the hypervisor is stopped and the reference is
+// reset, as the TSC is not guaranteed to survive a suspend. Each time the
+// reference is set after being reset, the generation is incremented. Any
+// vCPU that sees a new generation resyncs its guest's clock to the new
+// reference on its next VM entry (instead of the guest having to ask).
+//
+
+static std::mutex g_host_wc_mutex;
+static uint64_t g_host_wc_tsc{};
+static uint64_t g_host_wc_gen{};
+static struct timespec g_host_wc_rtc{};
+
 // -----------------------------------------------------------------------------
 // Implementation
 // -----------------------------------------------------------------------------
@@ -282,6 +411,11 @@ vclock_handler::vclock_handler(
     m_vcpu{vcpu},
     m_tsc_freq_khz{calibrate_tsc_freq_khz()}
 {
+    pvclock_time_scale(
+        NSEC_PER_SEC, m_tsc_freq_khz * 1000, m_pvclock_shift, m_pvclock_mul);
+    pvclock_time_scale(
+        m_tsc_freq_khz * 1000, NSEC_PER_SEC, m_nsec_to_tsc_shift, m_nsec_to_tsc_mul);
+
     if (vcpu->is_dom0()) {
         this->setup_dom0();
     }
@@ -295,31 +429,38 @@ vclock_handler::vclock_handler(
 //------------------------------------------------------------------------------
 
 void
-vclock_handler::set_host_wallclock_rtc(
-    uint64_t sec, uint64_t nsec) noexcept
+vclock_handler::set_host_wallclock(
+    uint64_t sec, uint64_t nsec, uint64_t tsc) noexcept
 {
-    m_host_wc_rtc.tv_sec = gsl::narrow_cast<int64_t>(sec);
-    m_host_wc_rtc.tv_nsec = gsl::narrow_cast<long>(nsec);
-}
+    std::lock_guard lock(g_host_wc_mutex);
 
-void
-vclock_handler::set_host_wallclock_tsc(uint64_t val) noexcept
-{ m_host_wc_tsc = val; }
+    if (g_host_wc_tsc == 0) {
+        __atomic_store_n(&g_host_wc_gen, g_host_wc_gen + 1, __ATOMIC_RELEASE);
+    }
+
+    g_host_wc_rtc.tv_sec = gsl::narrow_cast<int64_t>(sec);
+    g_host_wc_rtc.tv_nsec = gsl::narrow_cast<long>(nsec);
+    g_host_wc_tsc = tsc;
+}
 
 void
 vclock_handler::reset_host_wallclock(void) noexcept
 {
-    m_host_wc_rtc = {};
-    m_host_wc_tsc = {};
+    std::lock_guard lock(g_host_wc_mutex);
+
+    g_host_wc_rtc = {};
+    g_host_wc_tsc = {};
 }
 
 std::pair<struct timespec, uint64_t>
 vclock_handler::get_host_wallclock() const
 {
+    std::lock_guard lock(g_host_wc_mutex);
+
     auto tsc = ::x64::tsc::get();
-    auto elapsed_nsec = this->tsc_to_nsec(tsc - m_host_wc_tsc);
+    auto elapsed_nsec = this->tsc_to_nsec(tsc - g_host_wc_tsc);
 
-    return {inc_timespec(m_host_wc_rtc, elapsed_nsec), tsc};
+    return {inc_timespec(g_host_wc_rtc, elapsed_nsec), tsc};
 }
 
 //------------------------------------------------------------------------------
@@ -328,11 +469,40 @@ vclock_handler::get_host_wallclock() const
 
 void
 vclock_handler::set_guest_wallclock_rtc(void) noexcept
-{ m_guest_wc_rtc = m_host_wc_rtc; }
+{
+    // Note:
+    //
+    // Both the RTC and the TSC are copied (here and below) so that if the
+    // host wall clock is refreshed between the guest's calls to set the RTC
+    // and the TSC, the guest still ends up with a matching pair.
+    //
+
+    {
+        std::lock_guard lock(g_host_wc_mutex);
+
+        m_guest_wc_rtc = g_host_wc_rtc;
+        m_guest_wc_tsc = g_host_wc_tsc;
+        m_guest_wc_nsec = 0;
+        m_host_wc_gen = g_host_wc_gen;
+    }
+
+    this->update_vclock_page();
+}
 
 void
 vclock_handler::set_guest_wallclock_tsc(void) noexcept
-{ m_guest_wc_tsc = m_host_wc_tsc; }
+{
+    {
+        std::lock_guard lock(g_host_wc_mutex);
+
+        m_guest_wc_rtc = g_host_wc_rtc;
+        m_guest_wc_tsc = g_host_wc_tsc;
+        m_guest_wc_nsec = 0;
+        m_host_wc_gen = g_host_wc_gen;
+    }
+
+    this->update_vclock_page();
+}
 
 std::pair<struct timespec, uint64_t>
 vclock_handler::get_guest_wallclock() const
@@ -340,9 +510,53 @@ vclock_handler::get_guest_wallclock() const
     auto tsc = ::x64::tsc::get();
     auto elapsed_nsec = this->tsc_to_nsec(tsc - m_guest_wc_tsc);
 
-    return {inc_timespec(m_guest_wc_rtc, elapsed_nsec), tsc};
+    return {inc_timespec(m_guest_wc_rtc, m_guest_wc_nsec + elapsed_nsec), tsc};
+}
+
+//------------------------------------------------------------------------------
+// Steal Time
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::update_steal_time(uint64_t steal_tsc, bool preempted) noexcept
+{
+    auto page = m_steal_time_page.get();
+    if (page == nullptr) {
+        return;
+    }
+
+    // Note:
+    //
+    // Same as the vClock page, the fence makes sure the odd version is
+    // visible before the fields change (see update_vclock_page).
+    //
+
+    __atomic_store_n(&page->version, page->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    page->steal = this->tsc_to_nsec(steal_tsc);
+    page->preempted = preempted ? 1 : 0;
+
+    __atomic_store_n(&page->version, page->version + 1, __ATOMIC_RELEASE);
+}
+
+//------------------------------------------------------------------------------
+// LAPIC Timer
+//------------------------------------------------------------------------------
+
+void
+vclock_handler::set_lapic_timer(
+    uint64_t lvt, uint64_t deadline, uint64_t period) noexcept
+{
+    m_lapic_timer_lvt = lvt;
+    m_lapic_timer_deadline_tsc = deadline;
+    m_lapic_timer_period_tsc = deadline != 0 ? period : 0;
 }
 
+uint64_t
+vclock_handler::lapic_timer_deadline() const noexcept
+{ return m_lapic_timer_deadline_tsc; }
+
 //------------------------------------------------------------------------------
 // Time Helpers
 //------------------------------------------------------------------------------
@@ -353,11 +567,11 @@ vclock_handler::tsc_freq_khz() const noexcept
 
 uint64_t
 vclock_handler::tsc_to_nsec(uint64_t tsc) const noexcept
-{ return mul_div(tsc, 1000000, m_tsc_freq_khz); }
+{ return scale_delta(tsc, m_pvclock_mul, m_pvclock_shift); }
 
 uint64_t
 vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
-{ return mul_div(nsec, m_tsc_freq_khz, 1000000); }
+{ return scale_delta(nsec, m_nsec_to_tsc_mul, m_nsec_to_tsc_shift); }
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -366,18 +580,44 @@ vclock_handler::nsec_to_tsc(uint64_t nsec) const noexcept
 bool
 vclock_handler::handle_yield(vcpu *vcpu)
 {
-    auto next_event = m_next_event_tsc;
+    this->sync_next_event();
+    auto next_event = this->next_deadline();
 
     vcpu->advance();
-    this->inject_vclock_event();
 
-    if (auto tsc = ::x64::tsc::get(); tsc < next_event) {
-        auto nsec = this->tsc_to_nsec(next_event - tsc);
+    auto polled = this->halt_poll(vcpu, next_event);
+
+    // Note:
+    //
+    // The vClock event is only injected once its deadline has passed. If
+    // the poll stopped early (e.g. because input was given to the UART), or
+    // if the vCPU is returned to bfexec (which can be kicked before the
+    // deadline), the event stays armed and is queued by the resume delegate
+    // once it expires. A guest that yields without arming either timer is
+    // given a vClock event right away. A guest that only uses the emulated
+    // LAPIC timer does not have a vClock event handler, in which case the
+    // vClock event is not injected. The LAPIC timer is delivered by the
+    // resume delegate once it expires.
+    //
 
-        vcpu->parent_vcpu()->load();
-        vcpu->parent_vcpu()->return_yield(nsec);
+    auto tsc = ::x64::tsc::get();
+
+    if (m_next_event_tsc != 0) {
+        if (tsc >= m_next_event_tsc) {
+            this->inject_vclock_event();
+        }
+    }
+    else if (m_lapic_timer_deadline_tsc == 0) {
+        this->inject_vclock_event();
     }
 
+    if (polled || tsc >= next_event) {
+        return true;
+    }
+
+    vcpu->parent_vcpu()->load();
+    vcpu->parent_vcpu()->return_yield(next_event);
+
     return true;
 }
 
@@ -386,36 +626,51 @@ vclock_handler::handle_preemption_timer(vcpu *vcpu)
 {
     bfignored(vcpu);
 
-    this->queue_vclock_event();
-    return true;
+    // Note:
+    //
+    // The preemption timer is shared by the vClock event device and the
+    // LAPIC timer, and the guest might have moved its vClock deadline (using
+    // the vClock page) while it was running. Only the events that have
+    // expired are queued. The resume delegate rearms the preemption timer
+    // for whatever is left. If nothing expired, the exit is passed on to the
+    // quota handler, which also uses the preemption timer.
+    //
+
+    this->sync_next_event();
+    return this->queue_expired_events(::x64::tsc::get());
 }
 
 void
 vclock_handler::vclock_op__get_tsc_freq_khz(vcpu *vcpu)
 {
-    try {
-        vcpu->set_rax(this->tsc_freq_khz());
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    vcpu->set_rax(this->tsc_freq_khz());
 }
 
 void
 vclock_handler::vclock_op__set_next_event(vcpu *vcpu)
 {
-    try {
-        m_next_event_tsc = ::x64::tsc::get() + vcpu->rbx();
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    m_next_event_tsc = ::x64::tsc::get() + vcpu->rbx();
+    vcpu->set_rax(SUCCESS);
 }
 
 void
 vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu)
 {
+    // Note:
+    //
+    // If dom0 has already provided the host wall clock, there is no need to
+    // return to bfexec, and the guest can set its wall clock right away.
+    //
+
+    {
+        std::lock_guard lock(g_host_wc_mutex);
+
+        if (g_host_wc_tsc != 0) {
+            vcpu->set_rax(SUCCESS);
+            return;
+        }
+    }
+
     try {
         vcpu->set_rax(SUCCESS);
 
@@ -423,55 +678,84 @@ vclock_handler::vclock_op__reset_host_wallclock(vcpu *vcpu)
         vcpu->parent_vcpu()->return_set_wallclock();
     }
     catchall({
+
+        // Note:
+        //
+        // The domU vclock handler is a fast handler, which means the vmcall
+        // handler will not reload this vCPU's VMCS for us.
+        //
+
+        vcpu->load();
         vcpu->set_rax(FAILURE);
     })
 }
 
 void
-vclock_handler::vclock_op__set_host_wallclock_rtc(vcpu *vcpu)
+vclock_handler::vclock_op__set_host_wallclock(vcpu *vcpu)
 {
-    try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
-        child_vcpu->set_host_wallclock_rtc(vcpu->rcx(), vcpu->rdx());
+    this->set_host_wallclock(vcpu->rbx(), vcpu->rcx(), vcpu->rdx());
+    vcpu->set_rax(SUCCESS);
+}
 
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+void
+vclock_handler::vclock_op__set_guest_wallclock_rtc(vcpu *vcpu)
+{
+    this->set_guest_wallclock_rtc();
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_host_wallclock_tsc(vcpu *vcpu)
+vclock_handler::vclock_op__set_guest_wallclock_tsc(vcpu *vcpu)
 {
-    try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
-        child_vcpu->set_host_wallclock_tsc(vcpu->rcx());
+    this->set_guest_wallclock_tsc();
+    vcpu->set_rax(SUCCESS);
+}
 
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+void
+vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu)
+{
+    auto wallclock = this->get_guest_wallclock();
+
+    vcpu->set_rbx(static_cast<uint64_t>(wallclock.first.tv_sec));
+    vcpu->set_rcx(static_cast<uint64_t>(wallclock.first.tv_nsec));
+    vcpu->set_rdx(wallclock.second);
+
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_guest_wallclock_rtc(vcpu *vcpu)
+vclock_handler::vclock_op__sync_next_event(vcpu *vcpu)
 {
-    try {
-        this->set_guest_wallclock_rtc();
-        vcpu->set_rax(SUCCESS);
-    }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+    // Note:
+    //
+    // There is nothing to do here as the resume delegate reads the vClock
+    // page on every resume. This hypercall only exists to cause an exit.
+    //
+
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-vclock_handler::vclock_op__set_guest_wallclock_tsc(vcpu *vcpu)
+vclock_handler::vclock_op__set_steal_time_page(vcpu *vcpu)
 {
+    if (vcpu->rbx() == 0) {
+        m_steal_time_page.reset();
+        vcpu->set_rax(SUCCESS);
+
+        return;
+    }
+
+    if ((vcpu->rbx() & (sizeof(boxy_steal_time) - 1)) != 0) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
-        this->set_guest_wallclock_tsc();
+        m_steal_time_page = vcpu->map_gpa_4k<boxy_steal_time>(vcpu->rbx());
+
+        auto info = vcpu->runstate();
+        this->update_steal_time(info.time[BOXY_RUNSTATE_RUNNABLE], false);
+
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -480,14 +764,30 @@ vclock_handler::vclock_op__set_guest_wallclock_tsc(vcpu *vcpu)
 }
 
 void
-vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu)
+vclock_handler::vclock_op__set_vclock_page(vcpu *vcpu)
 {
-    try {
-        auto wallclock = this->get_guest_wallclock();
+    if (vcpu->rbx() == 0) {
+        m_vclock_page.reset();
+        vcpu->set_rax(SUCCESS);
 
-        vcpu->set_rbx(static_cast<uint64_t>(wallclock.first.tv_sec));
-        vcpu->set_rcx(static_cast<uint64_t>(wallclock.first.tv_nsec));
-        vcpu->set_rdx(wallclock.second);
+        return;
+    }
+
+    // Note:
+    //
+    // Only the page that holds the gpa is mapped, so like the steal time
+    // area, the vClock page has to be aligned so that it cannot run past the
+    // end of the map.
+    //
+
+    if ((vcpu->rbx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        m_vclock_page = vcpu->map_gpa_4k<boxy_vclock_page>(vcpu->rbx());
+        this->update_vclock_page();
 
         vcpu->set_rax(SUCCESS);
     }
@@ -499,21 +799,13 @@ vclock_handler::vclock_op__get_guest_wallclock(vcpu *vcpu)
 bool
 vclock_handler::dispatch_dom0(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
             break;
 
-        case hypercall_enum_vclock_op__set_host_wallclock_rtc:
-            vclock_op__set_host_wallclock_rtc(vcpu);
-            break;
-
-        case hypercall_enum_vclock_op__set_host_wallclock_tsc:
-            vclock_op__set_host_wallclock_tsc(vcpu);
+        case hypercall_enum_vclock_op__set_host_wallclock:
+            vclock_op__set_host_wallclock(vcpu);
             break;
 
         default:
@@ -526,10 +818,6 @@ vclock_handler::dispatch_dom0(vcpu *vcpu)
 bool
 vclock_handler::dispatch_domU(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vclock_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vclock_op__get_tsc_freq_khz:
             vclock_op__get_tsc_freq_khz(vcpu);
@@ -555,6 +843,18 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
             vclock_op__get_guest_wallclock(vcpu);
             break;
 
+        case hypercall_enum_vclock_op__set_vclock_page:
+            vclock_op__set_vclock_page(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__sync_next_event:
+            vclock_op__sync_next_event(vcpu);
+            break;
+
+        case hypercall_enum_vclock_op__set_steal_time_page:
+            vclock_op__set_steal_time_page(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown domU vclock op");
     };
@@ -565,19 +865,28 @@ vclock_handler::dispatch_domU(vcpu *vcpu)
 void
 vclock_handler::resume_delegate(vcpu_t *vcpu)
 {
-    if (m_next_event_tsc == 0 || m_guest_wc_tsc == 0) {
-        return;
+    this->resync_guest_wallclock();
+    this->sync_next_event();
+
+    auto tsc = ::x64::tsc::get();
+    this->adjust_halt_poll(tsc);
+    this->queue_expired_events(tsc);
+
+    auto deadline = this->next_deadline();
+
+    if (auto quota = m_vcpu->quota_deadline(); quota != 0) {
+        deadline = deadline != 0 ? std::min(deadline, quota) : quota;
     }
 
-    if (auto tsc = ::x64::tsc::get(); tsc < m_next_event_tsc) {
+    if (deadline != 0) {
         vcpu->set_preemption_timer(
-            ((m_next_event_tsc - tsc) >> m_pet_decrement) + 1
+            ((deadline - tsc) >> m_pet_decrement) + 1
         );
 
         return;
     }
 
-    this->queue_vclock_event();
+    vcpu->disable_preemption_timer();
 }
 
 // -----------------------------------------------------------------------------
@@ -588,7 +897,7 @@ void
 vclock_handler::setup_dom0()
 {
     m_vcpu->add_vmcall_handler(
-        {&vclock_handler::dispatch_dom0, this}
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_dom0, this}
     );
 }
 
@@ -602,8 +911,12 @@ vclock_handler::setup_domU()
         throw std::runtime_error("missing PET info. system not supported");
     }
 
-    m_vcpu->add_vmcall_handler(
-        {&vclock_handler::dispatch_domU, this}
+    m_halt_poll_min_tsc = this->nsec_to_tsc(halt_poll_min_nsec);
+    m_halt_poll_max_tsc = this->nsec_to_tsc(halt_poll_max_nsec);
+    m_halt_poll_tsc = m_halt_poll_min_tsc;
+
+    m_vcpu->add_fast_vmcall_handler(
+        hypercall_enum_vclock_op, {&vclock_handler::dispatch_domU, this}
     );
 
     m_vcpu->add_resume_delegate(
@@ -619,6 +932,138 @@ vclock_handler::setup_domU()
     );
 }
 
+void
+vclock_handler::update_vclock_page() noexcept
+{
+    auto page = m_vclock_page.get();
+    if (page == nullptr) {
+        return;
+    }
+
+    // Note:
+    //
+    // The guest's system time starts (i.e. is 0) when the guest's wall clock
+    // was captured, which means that the pvclock wall clock (which is the
+    // wall clock at system time 0) is simply the guest's wall clock. Once
+    // the guest's clock has been resynced (e.g. after a host resume), the
+    // TSC reference no longer lines up with system time 0, in which case
+    // m_guest_wc_nsec holds the system time at the TSC reference.
+    //
+
+    auto &time = page->time;
+    auto &wall_clock = page->wall_clock;
+
+    // Note:
+    //
+    // The odd versions must be visible before any of the fields change, and
+    // a release store only orders the stores that come before it, which is
+    // why a fence is needed after the odd versions are stored. The even
+    // versions are release stores, which orders them after the fields.
+    //
+
+    __atomic_store_n(&time.version, time.version + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&wall_clock.version, wall_clock.version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    time.tsc_timestamp = m_guest_wc_tsc;
+    time.system_time = m_guest_wc_nsec;
+    time.tsc_to_system_mul = m_pvclock_mul;
+    time.tsc_shift = m_pvclock_shift;
+    time.flags = BOXY_PVCLOCK_TSC_STABLE_BIT;
+
+    wall_clock.sec = gsl::narrow_cast<uint32_t>(m_guest_wc_rtc.tv_sec);
+    wall_clock.nsec = gsl::narrow_cast<uint32_t>(m_guest_wc_rtc.tv_nsec);
+
+    __atomic_store_n(&wall_clock.version, wall_clock.version + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&time.version, time.version + 1, __ATOMIC_RELEASE);
+}
+
+void
+vclock_handler::sync_next_event() noexcept
+{
+    auto page = m_vclock_page.get();
+    if (page == nullptr) {
+        return;
+    }
+
+    if (auto tsc = __atomic_exchange_n(&page->next_event_tsc, 0, __ATOMIC_ACQ_REL)) {
+        m_next_event_tsc = tsc;
+    }
+}
+
+// Note:
+//
+// Events that are raised by another physical CPU (e.g. input that dom0
+// gives to the UART) are only turned into vIRQs by the resume delegates,
+// which do not run while we poll. The UART's pending flag is atomic, and is
+// checked directly so that the poll stops as soon as input arrives.
+//
+
+static bool
+event_pending(vcpu *vcpu) noexcept
+{
+    return vcpu->has_pending_virtual_interrupts() ||
+           vcpu->dom()->uart_irq_pending();
+}
+
+bool
+vclock_handler::halt_poll(vcpu *vcpu, uint64_t next_event)
+{
+    auto start = ::x64::tsc::get();
+
+    if (start >= next_event) {
+        return true;
+    }
+
+    while (true) {
+        if (event_pending(vcpu)) {
+            return true;
+        }
+
+        auto tsc = ::x64::tsc::get();
+
+        if (tsc >= next_event) {
+            return true;
+        }
+
+        if (tsc - start >= m_halt_poll_tsc) {
+            break;
+        }
+
+        __builtin_ia32_pause();
+    }
+
+    // Note:
+    //
+    // The poll gave up, so the vCPU is about to sleep in bfexec. The time
+    // the poll started is remembered so that, once the vCPU is resumed,
+    // adjust_halt_poll can tell how long it actually slept.
+    //
+
+    m_halt_poll_start_tsc = start;
+    return false;
+}
+
+void
+vclock_handler::adjust_halt_poll(uint64_t tsc) noexcept
+{
+    if (m_halt_poll_start_tsc == 0) {
+        return;
+    }
+
+    auto block_tsc = tsc - m_halt_poll_start_tsc;
+    m_halt_poll_start_tsc = 0;
+
+    if (block_tsc <= m_halt_poll_max_tsc) {
+        m_halt_poll_tsc =
+            std::min(m_halt_poll_tsc * halt_poll_grow, m_halt_poll_max_tsc);
+    }
+    else {
+        m_halt_poll_tsc =
+            std::max(m_halt_poll_tsc / halt_poll_shrink, m_halt_poll_min_tsc);
+    }
+}
+
 void
 vclock_handler::queue_vclock_event()
 {
@@ -637,6 +1082,117 @@ vclock_handler::inject_vclock_event()
     m_next_event_tsc = 0;
 }
 
+void
+vclock_handler::queue_lapic_timer_event(uint64_t tsc)
+{
+    constexpr const auto lvt_vector_mask = 0xFFULL;
+    constexpr const auto lvt_masked = 1ULL << 16U;
+
+    if ((m_lapic_timer_lvt & lvt_masked) == 0) {
+        m_vcpu->queue_external_interrupt(m_lapic_timer_lvt & lvt_vector_mask);
+    }
+
+    // Note:
+    //
+    // If the guest was not running when the periodic timer expired, more
+    // than one period might have passed. Like real hardware, only one
+    // interrupt is delivered for all of the periods that were missed.
+    //
+
+    if (auto period = m_lapic_timer_period_tsc; period != 0) {
+        m_lapic_timer_deadline_tsc +=
+            (((tsc - m_lapic_timer_deadline_tsc) / period) + 1) * period;
+    }
+    else {
+        m_lapic_timer_deadline_tsc = 0;
+    }
+}
+
+bool
+vclock_handler::queue_expired_events(uint64_t tsc)
+{
+    auto queued = false;
+
+    if (m_lapic_timer_deadline_tsc != 0 && tsc >= m_lapic_timer_deadline_tsc) {
+        this->queue_lapic_timer_event(tsc);
+        queued = true;
+    }
+
+    if (m_next_event_tsc != 0 && m_guest_wc_tsc != 0 && tsc >= m_next_event_tsc) {
+        this->queue_vclock_event();
+        queued = true;
+    }
+
+    return queued;
+}
+
+void
+vclock_handler::resync_guest_wallclock() noexcept
+{
+    if (__atomic_load_n(&g_host_wc_gen, __ATOMIC_ACQUIRE) == m_host_wc_gen) {
+        return;
+    }
+
+    {
+        std::lock_guard lock(g_host_wc_mutex);
+
+        m_host_wc_gen = g_host_wc_gen;
+
+        if (m_guest_wc_tsc == 0 || g_host_wc_tsc == 0) {
+            return;
+        }
+
+        // Note:
+        //
+        // The guest's wall clock (i.e. system time 0) does not change. The
+        // system time at the new TSC reference is the time that has passed
+        // on the host since then, which includes the time the host was
+        // suspended. System time is never allowed to go backwards.
+        //
+
+        auto elapsed = sub_timespec(g_host_wc_rtc, m_guest_wc_rtc);
+        if (elapsed.tv_sec >= 0) {
+            auto nsec =
+                (static_cast<uint64_t>(elapsed.tv_sec) * NSEC_PER_SEC) +
+                static_cast<uint64_t>(elapsed.tv_nsec);
+
+            m_guest_wc_nsec = std::max(m_guest_wc_nsec, nsec);
+        }
+
+        m_guest_wc_tsc = g_host_wc_tsc;
+    }
+
+    this->update_vclock_page();
+
+    // Note:
+    //
+    // Any armed deadlines were set against the old TSC, so they are expired
+    // right away, which gives the guest a chance to rearm them.
+    //
+
+    auto tsc = ::x64::tsc::get();
+
+    if (m_next_event_tsc != 0) {
+        m_next_event_tsc = tsc;
+    }
+
+    if (m_lapic_timer_deadline_tsc != 0) {
+        m_lapic_timer_deadline_tsc = tsc;
+    }
+}
+
+uint64_t
+vclock_handler::next_deadline() const noexcept
+{
+    auto next_event = m_guest_wc_tsc != 0 ? m_next_event_tsc : 0;
+
+    if (next_event == 0 || m_lapic_timer_deadline_tsc == 0) {
+        return next_event | m_lapic_timer_deadline_tsc;
+    }
+
+    return std::min(next_event, m_lapic_timer_deadline_tsc);
+}
+
 }
 
 
@@ -38,8 +38,8 @@ virq_handler::virq_handler(
         return;
     }
 
-    m_vcpu->add_vmcall_handler(
-        {&virq_handler::dispatch, this}
+    m_vcpu->add_fast_vmcall_handler(
+        hypercall_enum_virq_op, {&virq_handler::dispatch, this}
     );
 }
 
@@ -50,6 +50,14 @@ virq_handler::virq_handler(
 void
 virq_handler::queue_virtual_interrupt(uint64_t vector)
 {
+    if (m_virq_page) {
+        if (this->set_pending(vector)) {
+            m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
     m_vcpu->queue_external_interrupt(m_hypervisor_callback_vector);
 }
@@ -57,10 +65,53 @@ virq_handler::queue_virtual_interrupt(uint64_t vector)
 void
 virq_handler::inject_virtual_interrupt(uint64_t vector)
 {
+    if (m_virq_page) {
+        if (this->set_pending(vector)) {
+            m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
+        }
+
+        return;
+    }
+
     m_interrupt_queue.push(vector);
     m_vcpu->inject_external_interrupt(m_hypervisor_callback_vector);
 }
 
+bool
+virq_handler::has_pending_virtual_interrupts() const noexcept
+{
+    if (auto page = m_virq_page.get()) {
+        for (auto i = 0U; i < BOXY_VIRQ_MAX / 64; i++) {
+            auto pending = __atomic_load_n(&page->pending[i], __ATOMIC_ACQUIRE);
+            if ((pending & ~page->mask[i]) != 0) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    return !m_interrupt_queue.empty();
+}
+
+bool
+virq_handler::set_pending(uint64_t vector) noexcept
+{
+    auto page = m_virq_page.get();
+
+    auto index = boxy_virq__index(vector);
+    auto word = index / 64;
+    auto bit = 1ULL << (index % 64);
+
+    __atomic_fetch_or(&page->pending[word], bit, __ATOMIC_ACQ_REL);
+
+    if ((__atomic_load_n(&page->mask[word], __ATOMIC_ACQUIRE) & bit) != 0) {
+        return false;
+    }
+
+    return __atomic_exchange_n(&page->upcall_pending, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
 // -----------------------------------------------------------------------------
 // Handlers
 // -----------------------------------------------------------------------------
@@ -69,24 +120,61 @@ void
 virq_handler::virq_op__set_hypervisor_callback_vector(
     vcpu *vcpu)
 {
-    try {
-        m_hypervisor_callback_vector = vcpu->rbx();
-        vcpu->set_rax(SUCCESS);
+    m_hypervisor_callback_vector = vcpu->rbx();
+    vcpu->set_rax(SUCCESS);
+}
+
+void
+virq_handler::virq_op__get_next_virq(vcpu *vcpu)
+{
+    if (auto page = m_virq_page.get()) {
+        vcpu->set_rax(boxy_virq_page__next_virq(page));
+        return;
     }
-    catchall({
+
+    if (m_interrupt_queue.empty()) {
         vcpu->set_rax(FAILURE);
-    })
+        return;
+    }
+
+    vcpu->set_rax(m_interrupt_queue.pop());
 }
 
 void
-virq_handler::virq_op__get_next_virq(vcpu *vcpu)
+virq_handler::virq_op__set_virq_page(vcpu *vcpu)
 {
+    if (vcpu->rbx() == 0) {
+        m_virq_page.reset();
+        vcpu->set_rax(SUCCESS);
+
+        return;
+    }
+
+    // Note:
+    //
+    // Only the page that holds the gpa is mapped, so the gpa has to be page
+    // aligned, otherwise the bitmaps could run past the end of the map.
+    //
+
+    if ((vcpu->rbx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
-        if (m_interrupt_queue.empty()) {
-            throw std::runtime_error("virq queue empty");
+        m_virq_page = vcpu->map_gpa_4k<boxy_virq_page>(vcpu->rbx());
+
+        // Note:
+        //
+        // Any vIRQs that were queued before the page was registered are
+        // moved to the page so that the guest only has one place to look.
+        //
+
+        while (!m_interrupt_queue.empty()) {
+            this->set_pending(m_interrupt_queue.pop());
         }
 
-        vcpu->set_rax(m_interrupt_queue.pop());
+        vcpu->set_rax(SUCCESS);
     }
     catchall({
         vcpu->set_rax(FAILURE);
@@ -96,10 +184,6 @@ virq_handler::virq_op__get_next_virq(vcpu *vcpu)
 bool
 virq_handler::dispatch(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_virq_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_virq_op__set_hypervisor_callback_vector:
             virq_op__set_hypervisor_callback_vector(vcpu);
@@ -109,6 +193,10 @@ virq_handler::dispatch(vcpu *vcpu)
             virq_op__get_next_virq(vcpu);
             break;
 
+        case hypercall_enum_virq_op__set_virq_page:
+            virq_op__set_virq_page(vcpu);
+            break;
+
         default:
             vcpu->halt("unknown virq op");
     };
@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <algorithm>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/domain.h>
 #include <hve/arch/intel_x64/vmcall/domain_op.h>
@@ -35,9 +37,36 @@ domain_op_handler::domain_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&domain_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_domain_op, {&domain_op_handler::dispatch, this}
+    );
 }
 
+// -----------------------------------------------------------------------------
+// Helpers
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Most of the domain ops operate on a domain other than the caller's. This
+// returns nullptr if the domain is the caller or does not exist so that the
+// hypercall can fail without having to throw.
+//
+
+static domain *
+foreign_domain(vcpu *vcpu)
+{
+    if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
+        return nullptr;
+    }
+
+    return try_get_domain(vcpu->rbx());
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
 void
 domain_op_handler::domain_op__create_domain(vcpu *vcpu)
 {
@@ -53,12 +82,12 @@ domain_op_handler::domain_op__create_domain(vcpu *vcpu)
 void
 domain_op_handler::domain_op__destroy_domain(vcpu *vcpu)
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__destroy_domain: self not supported");
-        }
+    if (foreign_domain(vcpu) == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
         g_dm->destroy(vcpu->rbx());
         vcpu->set_rax(SUCCESS);
     }
@@ -70,16 +99,14 @@ domain_op_handler::domain_op__destroy_domain(vcpu *vcpu)
 void
 domain_op_handler::domain_op__set_uart(vcpu *vcpu)
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__set_uart: self not supported");
-        }
-
-        get_domain(vcpu->rbx())->set_uart(
-            gsl::narrow_cast<uart::port_type>(vcpu->rcx())
-        );
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
+        dom->set_uart(gsl::narrow_cast<uart::port_type>(vcpu->rcx()));
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -90,16 +117,14 @@ domain_op_handler::domain_op__set_uart(vcpu *vcpu)
 void
 domain_op_handler::domain_op__set_pt_uart(vcpu *vcpu)
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__set_pt_uart: self not supported");
-        }
-
-        get_domain(vcpu->rbx())->set_pt_uart(
-            gsl::narrow_cast<uart::port_type>(vcpu->rcx())
-        );
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
+    try {
+        dom->set_pt_uart(gsl::narrow_cast<uart::port_type>(vcpu->rcx()));
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -110,14 +135,18 @@ domain_op_handler::domain_op__set_pt_uart(vcpu *vcpu)
 void
 domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
 {
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(0);
+        return;
+    }
+
     try {
         auto buffer =
             vcpu->map_gva_4k<char>(vcpu->rcx(), UART_MAX_BUFFER);
 
         auto bytes_transferred =
-            get_domain(vcpu->rbx())->dump_uart(
-                gsl::span(buffer.get(), UART_MAX_BUFFER)
-            );
+            dom->dump_uart(gsl::span(buffer.get(), UART_MAX_BUFFER));
 
         vcpu->set_rax(bytes_transferred);
     }
@@ -127,18 +156,47 @@ domain_op_handler::domain_op__dump_uart(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_r(vcpu *vcpu)
+domain_op_handler::domain_op__set_uart_ring(vcpu *vcpu)
 {
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+
+        // Note:
+        //
+        // The domain's UARTs (and their rings) are gone once the domain is
+        // destroyed, so releasing the ring of a domain that no longer
+        // exists succeeds. This lets the builder free a ring that outlived
+        // its domain.
+        //
+
+        vcpu->set_rax(vcpu->rcx() == 0 ? SUCCESS : FAILURE);
+        return;
+    }
+
     try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
+        if (vcpu->rcx() == 0) {
+            dom->set_uart_ring({});
+            vcpu->set_rax(SUCCESS);
+            return;
+        }
+
+        if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+            vcpu->set_rax(FAILURE);
+            return;
         }
 
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
+        // Note:
+        //
+        // The ring is physically contiguous (it is allocated by the
+        // builder driver), and dom0's memory is identity mapped, so it can
+        // be mapped as a single range starting at its gpa.
+        //
+
+        dom->set_uart_ring(
+            vcpu->map_gpa_4k<boxy_uart_ring>(
+                vcpu->rcx(), sizeof(boxy_uart_ring))
+        );
 
-        get_domain(vcpu->rbx())->map_4k_r(vcpu->rdx(), hpa);
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -147,19 +205,27 @@ domain_op_handler::domain_op__share_page_r(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_rw(vcpu *vcpu)
+domain_op_handler::domain_op__write_uart(vcpu *vcpu)
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
-        }
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
+    auto size = std::min<uint64_t>(vcpu->rdx(), UART_MAX_BUFFER);
+    if (size == 0) {
+        vcpu->set_rax(0);
+        return;
+    }
 
-        get_domain(vcpu->rbx())->map_4k_rw(vcpu->rdx(), hpa);
-        vcpu->set_rax(SUCCESS);
+    try {
+        auto buffer = vcpu->map_gva_4k<char>(vcpu->rcx(), size);
+
+        vcpu->set_rax(
+            dom->write_uart(
+                gsl::span<const char>(buffer.get(), static_cast<std::ptrdiff_t>(size)))
+        );
     }
     catchall({
         vcpu->set_rax(FAILURE);
@@ -167,130 +233,150 @@ domain_op_handler::domain_op__share_page_rw(vcpu *vcpu)
 }
 
 void
-domain_op_handler::domain_op__share_page_rwe(vcpu *vcpu)
+domain_op_handler::domain_op__dump_uart_buffer(vcpu *vcpu)
 {
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__share_page: self not supported");
-        }
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
 
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
+    vcpu->set_rax(dom->dump_uart(vcpu->rcx()));
+}
 
-        get_domain(vcpu->rbx())->map_4k_rwe(vcpu->rdx(), hpa);
-        vcpu->set_rax(SUCCESS);
+void
+domain_op_handler::domain_op__set_cpu_quota(vcpu *vcpu)
+{
+    auto dom = foreign_domain(vcpu);
+    if (dom == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
     }
-    catchall({
+
+    if (vcpu->rcx() > vcpu->rdx()) {
         vcpu->set_rax(FAILURE);
-    })
+        return;
+    }
+
+    dom->set_cpu_quota(vcpu->rcx(), vcpu->rdx());
+    vcpu->set_rax(SUCCESS);
 }
 
 void
-domain_op_handler::domain_op__donate_page_r(vcpu *vcpu)
+domain_op_handler::domain_op__register_buffer(vcpu *vcpu)
 {
-    // TODO:
-    //
-    // We need to remove the gpa from the current domain before the gpa is
-    // donated to the other guest. For now, this function is identical to
-    // sharing as both domains have access to the backing page.
-    //
-
-    try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
-        }
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
+        vcpu->set_rax(INVALID_BUFFER);
+        return;
+    }
 
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
+    auto size = vcpu->rdx();
+    if (size == 0 || size > BOXY_MAX_BUFFER_SIZE) {
+        vcpu->set_rax(INVALID_BUFFER);
+        return;
+    }
 
-        get_domain(vcpu->rbx())->map_4k_r(vcpu->rdx(), hpa);
-        vcpu->set_rax(SUCCESS);
+    if ((vcpu->rcx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+        vcpu->set_rax(INVALID_BUFFER);
+        return;
     }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
-}
 
-void
-domain_op_handler::domain_op__donate_page_rw(vcpu *vcpu)
-{
-    // TODO:
+    // Note:
     //
-    // We need to remove the gpa from the current domain before the gpa is
-    // donated to the other guest. For now, this function is identical to
-    // sharing as both domains have access to the backing page.
+    // Like the UART ring, the buffer is physically contiguous (it is
+    // allocated by the builder driver), so it is mapped as a single range
+    // starting at its gpa.
     //
 
     try {
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
-        }
-
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
-
-        get_domain(vcpu->rbx())->map_4k_rw(vcpu->rdx(), hpa);
-        vcpu->set_rax(SUCCESS);
+        vcpu->set_rax(
+            dom->register_buffer(
+                vcpu->map_gpa_4k<char>(vcpu->rcx(), size), size)
+        );
     }
     catchall({
-        vcpu->set_rax(FAILURE);
+        vcpu->set_rax(INVALID_BUFFER);
     })
 }
 
 void
-domain_op_handler::domain_op__donate_page_rwe(vcpu *vcpu)
+domain_op_handler::domain_op__unregister_buffer(vcpu *vcpu)
 {
-    // TODO:
+    // Note:
     //
-    // We need to remove the gpa from the current domain before the gpa is
-    // donated to the other guest. For now, this function is identical to
-    // sharing as both domains have access to the backing page.
+    // A domain's buffers are unregistered when the domain is destroyed, so
+    // unregistering a buffer of a domain that no longer exists succeeds.
     //
 
-    try {
-
-        if (vcpu->rbx() == self || vcpu->rbx() == vcpu->domid()) {
-            throw std::runtime_error(
-                "domain_op__donate_page: self not supported");
-        }
-
-        auto [hpa, unused] =
-            vcpu->gpa_to_hpa(vcpu->rcx());
-
-        get_domain(vcpu->rbx())->map_4k_rwe(vcpu->rdx(), hpa);
+    auto dom = try_get_domain(vcpu->rbx());
+    if (dom == nullptr) {
         vcpu->set_rax(SUCCESS);
+        return;
     }
-    catchall({
-        vcpu->set_rax(FAILURE);
-    })
+
+    vcpu->set_rax(dom->unregister_buffer(vcpu->rcx()) ? SUCCESS : FAILURE);
 }
 
-#define domain_op__reg(reg)                                                     \
+#define domain_op__map_page(name, map)                                          \
     void                                                                        \
-    domain_op_handler::domain_op__ ## reg(vcpu *vcpu)                    \
+    domain_op_handler::domain_op__ ## name(vcpu *vcpu)                          \
     {                                                                           \
+        auto dom = foreign_domain(vcpu);                                        \
+        if (dom == nullptr) {                                                   \
+            vcpu->set_rax(FAILURE);                                             \
+            return;                                                             \
+        }                                                                       \
+                                                                                \
         try {                                                                   \
-            vcpu->set_rax(get_domain(vcpu->rbx())->reg());                      \
+            auto [hpa, unused] = vcpu->gpa_to_hpa(vcpu->rcx());                 \
+                                                                                \
+            dom->map(vcpu->rdx(), hpa);                                         \
+            vcpu->set_rax(SUCCESS);                                             \
         }                                                                       \
         catchall({                                                              \
             vcpu->set_rax(FAILURE);                                             \
         })                                                                      \
     }
 
+domain_op__map_page(share_page_r, map_4k_r);
+domain_op__map_page(share_page_rw, map_4k_rw);
+domain_op__map_page(share_page_rwe, map_4k_rwe);
+
+// TODO:
+//
+// We need to remove the gpa from the current domain before the gpa is
+// donated to the other guest. For now, donating is identical to sharing as
+// both domains have access to the backing page.
+//
+
+domain_op__map_page(donate_page_r, map_4k_r);
+domain_op__map_page(donate_page_rw, map_4k_rw);
+domain_op__map_page(donate_page_rwe, map_4k_rwe);
+
+#define domain_op__reg(reg)                                                     \
+    void                                                                        \
+    domain_op_handler::domain_op__ ## reg(vcpu *vcpu)                           \
+    {                                                                           \
+        if (auto dom = try_get_domain(vcpu->rbx())) {                           \
+            vcpu->set_rax(dom->reg());                                          \
+            return;                                                             \
+        }                                                                       \
+                                                                                \
+        vcpu->set_rax(FAILURE);                                                 \
+    }
+
 #define domain_op__set_reg(reg)                                                 \
     void                                                                        \
-    domain_op_handler::domain_op__set_ ## reg(vcpu *vcpu)                \
+    domain_op_handler::domain_op__set_ ## reg(vcpu *vcpu)                       \
     {                                                                           \
-        try {                                                                   \
-            get_domain(vcpu->rbx())->set_ ## reg(vcpu->rcx());                  \
+        if (auto dom = try_get_domain(vcpu->rbx())) {                           \
+            dom->set_ ## reg(vcpu->rcx());                                      \
             vcpu->set_rax(SUCCESS);                                             \
+            return;                                                             \
         }                                                                       \
-        catchall({                                                              \
-            vcpu->set_rax(FAILURE);                                             \
-        })                                                                      \
+                                                                                \
+        vcpu->set_rax(FAILURE);                                                 \
     }
 
 domain_op__reg(rax);
@@ -419,10 +505,6 @@ domain_op__set_reg(ldtr_access_rights);
 bool
 domain_op_handler::dispatch(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_domain_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
             dispatch_case(create_domain)
             dispatch_case(destroy_domain)
@@ -430,6 +512,14 @@ domain_op_handler::dispatch(vcpu *vcpu)
             dispatch_case(set_uart)
             dispatch_case(set_pt_uart)
             dispatch_case(dump_uart)
+            dispatch_case(set_uart_ring)
+            dispatch_case(write_uart)
+            dispatch_case(dump_uart_buffer)
+
+            dispatch_case(set_cpu_quota)
+
+            dispatch_case(register_buffer)
+            dispatch_case(unregister_buffer)
 
             dispatch_case(share_page_r)
             dispatch_case(share_page_rw)
@@ -560,7 +650,7 @@ domain_op_handler::dispatch(vcpu *vcpu)
             break;
     };
 
-    throw std::runtime_error("unknown domain opcode");
+    return false;
 }
 
 }
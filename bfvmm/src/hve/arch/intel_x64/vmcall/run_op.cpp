@@ -34,7 +34,9 @@ run_op_handler::run_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&run_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_run_op, {&run_op_handler::dispatch, this}
+    );
 }
 
 bool
@@ -52,12 +54,8 @@ run_op_handler::dispatch(vcpu *vcpu)
     // - Do no assume that the parent vCPU is always the same. It is possible
     //   for the host to change the parent vCPU the next time this is executed.
     //   If this happens, a VMCS migration must take place.
-    // - This handler should be the first handler to be called. This way, we
-    //   do no end up looping through the vmcall handlers on every interrupt.
-
-    if (bfopcode(vcpu->rax()) != hypercall_enum_run_op) {
-        return false;
-    }
+    // - This handler is called directly from the vmcall handler's dispatch
+    //   table, so there is no need to check the opcode here.
 
     try {
         if (m_child_vcpuid != vcpu->rbx()) {
@@ -69,12 +67,14 @@ run_op_handler::dispatch(vcpu *vcpu)
 
         if (m_child_vcpu->is_alive()) {
             m_child_vcpu->load();
+            m_child_vcpu->set_runstate(BOXY_RUNSTATE_RUNNING);
 
             try {
                 m_child_vcpu->prepare_for_world_switch();
                 m_child_vcpu->run();
             }
             catch (...) {
+                m_child_vcpu->set_runstate(BOXY_RUNSTATE_BLOCKED);
                 vcpu->prepare_for_world_switch();
                 throw;
             }
@@ -89,4 +89,12 @@ run_op_handler::dispatch(vcpu *vcpu)
     return true;
 }
 
+void
+run_op_handler::set_child_runstate(uint64_t state) noexcept
+{
+    if (m_child_vcpu != nullptr) {
+        m_child_vcpu->set_runstate(state);
+    }
+}
+
 }
@@ -35,7 +35,9 @@ vcpu_op_handler::vcpu_op_handler(
         return;
     }
 
-    vcpu->add_vmcall_handler({&vcpu_op_handler::dispatch, this});
+    vcpu->add_vmcall_handler(
+        hypercall_enum_vcpu_op, {&vcpu_op_handler::dispatch, this}
+    );
 }
 
 void
@@ -53,10 +55,20 @@ vcpu_op_handler::vcpu_op__create_vcpu(vcpu *vcpu)
 void
 vcpu_op_handler::vcpu_op__kill_vcpu(vcpu *vcpu)
 {
-    try {
-        auto child_vcpu = get_vcpu(vcpu->rbx());
+    if (auto child_vcpu = try_get_vcpu(vcpu->rbx())) {
         child_vcpu->kill();
+        vcpu->set_rax(SUCCESS);
+        return;
+    }
+
+    vcpu->set_rax(FAILURE);
+}
 
+void
+vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
+{
+    try {
+        g_vcm->destroy(vcpu->rbx());
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -65,10 +77,19 @@ vcpu_op_handler::vcpu_op__kill_vcpu(vcpu *vcpu)
 }
 
 void
-vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
+vcpu_op_handler::vcpu_op__get_runstate(vcpu *vcpu)
 {
+    auto child_vcpu = try_get_vcpu(vcpu->rbx());
+    if (child_vcpu == nullptr) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
     try {
-        g_vcm->destroy(vcpu->rbx());
+        auto info = vcpu->map_gva_4k<boxy_runstate_info>(
+            vcpu->rcx(), sizeof(boxy_runstate_info));
+
+        *info.get() = child_vcpu->runstate();
         vcpu->set_rax(SUCCESS);
     }
     catchall({
@@ -79,10 +100,6 @@ vcpu_op_handler::vcpu_op__destroy_vcpu(vcpu *vcpu)
 bool
 vcpu_op_handler::dispatch(vcpu *vcpu)
 {
-    if (bfopcode(vcpu->rax()) != hypercall_enum_vcpu_op) {
-        return false;
-    }
-
     switch (vcpu->rax()) {
         case hypercall_enum_vcpu_op__create_vcpu:
             this->vcpu_op__create_vcpu(vcpu);
@@ -96,11 +113,15 @@ vcpu_op_handler::dispatch(vcpu *vcpu)
             this->vcpu_op__destroy_vcpu(vcpu);
             return true;
 
+        case hypercall_enum_vcpu_op__get_runstate:
+            this->vcpu_op__get_runstate(vcpu);
+            return true;
+
         default:
             break;
     };
 
-    throw std::runtime_error("unknown vcpu opcode");
+    return false;
 }
 
 }
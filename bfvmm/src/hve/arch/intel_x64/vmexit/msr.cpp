@@ -19,6 +19,8 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <atomic>
+
 #include <hve/arch/intel_x64/vcpu.h>
 #include <hve/arch/intel_x64/vmexit/msr.h>
 
@@ -36,10 +38,23 @@
 namespace boxy::intel_x64
 {
 
+// Note:
+//
+// This is the owner of the isolated MSRs that are currently loaded into the
+// hardware of this physical CPU, or 0 if they are not known. Each MSR
+// handler is given an owner ID that is never reused (unlike vcpuids, as the
+// dom0 vCPUs are recreated with the same vcpuids each time the hypervisor is
+// started), so a handler that is destroyed can never be mistaken for the
+// owner of the MSRs.
+//
+std::atomic<uint64_t> g_next_owner_id{1};
+thread_local uint64_t t_msrs_owner_id{};
+
 msr_handler::msr_handler(
     gsl::not_null<vcpu *> vcpu
 ) :
-    m_vcpu{vcpu}
+    m_vcpu{vcpu},
+    m_owner_id{g_next_owner_id.fetch_add(1, std::memory_order_relaxed)}
 {
     using namespace vmcs_n;
 
@@ -75,6 +90,13 @@ msr_handler::msr_handler(
     EMULATE_MSR(0x0000064E, handle_rdmsr_0x0000064E, handle_wrmsr_0x0000064E);
 }
 
+msr_handler::~msr_handler()
+{
+    if (t_msrs_owner_id == m_owner_id) {
+        t_msrs_owner_id = 0;
+    }
+}
+
 // -----------------------------------------------------------------------------
 // Isolate MSR Functions
 // -----------------------------------------------------------------------------
@@ -143,9 +165,38 @@ msr_handler::isolate_msr__on_world_switch(vcpu_t *vcpu)
     //   every single VM exit.
     //
 
+    // Note:
+    //
+    // If the hardware already holds this vCPU's isolated MSRs (e.g. the
+    // vCPU is being resumed after an exit that did not result in a world
+    // switch), there is nothing to restore. Writes to an isolated MSR reset
+    // the tracking, and the kernel_gs_base is saved on every exit so the
+    // hardware and m_msrs are in sync.
+    //
+
+    if (t_msrs_owner_id == m_owner_id) {
+        return;
+    }
+
     for (const auto &msr : m_msrs) {
         ::x64::msrs::set(msr.first, msr.second);
     }
+
+    t_msrs_owner_id = m_owner_id;
+}
+
+void
+msr_handler::isolate_msr__reset() noexcept
+{
+    // Note:
+    //
+    // This must be called on each physical CPU when the hypervisor is
+    // stopped, as the host is free to change the MSRs of a physical CPU
+    // while the hypervisor is not running (e.g. while suspended), and the
+    // domU vCPUs (and their owner IDs) survive a stop.
+    //
+
+    t_msrs_owner_id = 0;
 }
 
 bool
@@ -176,6 +227,8 @@ msr_handler::isolate_msr__on_write(
     bfignored(vcpu);
 
     m_msrs[info.msr] = info.val;
+    t_msrs_owner_id = 0;
+
     return true;
 }
 
@@ -36,6 +36,11 @@ vmcall_handler::vmcall_handler(
         exit_reason::basic_exit_reason::vmcall,
         {&vmcall_handler::handle, this}
     );
+
+    this->add_fast_handler(
+        hypercall_enum_multicall_op,
+        {&vmcall_handler::handle_multicall, this}
+    );
 }
 
 // -----------------------------------------------------------------------------
@@ -44,8 +49,24 @@ vmcall_handler::vmcall_handler(
 
 void
 vmcall_handler::add_handler(
-    const handler_delegate_t &d)
-{ m_handlers.push_back(d); }
+    uint64_t opcode, const handler_delegate_t &d)
+{
+    auto &handler = m_handlers.at(opcode);
+
+    if (handler.enabled) {
+        throw std::runtime_error("vmcall opcode already registered");
+    }
+
+    handler = {d, true, false};
+}
+
+void
+vmcall_handler::add_fast_handler(
+    uint64_t opcode, const handler_delegate_t &d)
+{
+    this->add_handler(opcode, d);
+    m_handlers.at(opcode).fast = true;
+}
 
 // -----------------------------------------------------------------------------
 // Handlers
@@ -75,19 +96,39 @@ vmcall_error(gsl::not_null<vcpu *> vcpu, const std::string &str)
 }
 
 bool
-vmcall_handler::handle(vcpu_t *vcpu)
+vmcall_handler::dispatch(const handler_t &handler)
 {
+    if (handler.fast) {
+        return handler.delegate(m_vcpu);
+    }
+
     auto ___ = gsl::finally([&] {
-        vcpu->load();
+        m_vcpu->load();
     });
 
+    return handler.delegate(m_vcpu);
+}
+
+bool
+vmcall_handler::handle(vcpu_t *vcpu)
+{
     vcpu->advance();
 
+    // Note:
+    //
+    // bfopcode() returns an 8bit value, so it can be used to index the
+    // dispatch table directly without the need for a bounds check.
+    //
+
+    const auto &handler = m_handlers[bfopcode(vcpu->rax())];
+
+    if (!handler.enabled) {
+        return vmcall_error(m_vcpu, "unknown vmcall");
+    }
+
     try {
-        for (const auto &d : m_handlers) {
-            if (d(m_vcpu)) {
-                return true;
-            }
+        if (this->dispatch(handler)) {
+            return true;
         }
     }
     catchall({
@@ -97,4 +138,238 @@ vmcall_handler::handle(vcpu_t *vcpu)
     return vmcall_error(m_vcpu, "unknown vmcall");
 }
 
+// -----------------------------------------------------------------------------
+// Multicall
+// -----------------------------------------------------------------------------
+
+// Note:
+//
+// Only the hypercalls listed here can be batched. A run_op cannot be batched
+// as it does not return until the child vCPU exits, nested multicalls are
+// not allowed so that the amount of work done in a single exit stays
+// bounded, and hypercalls that might hand control back to dom0 (e.g. vclock
+// reset_host_wallclock) would abandon the rest of the batch. Hypercalls are
+// also only listed if the handler for the caller's type of domain fails
+// (instead of halting) when given a sub-op it does not know, and if all of
+// their output is in rax, as that is the only register that is written back
+// to the entry (e.g. vclock get_guest_wallclock cannot be batched).
+//
+
+static bool
+multicall_allowed(vcpu *vcpu, uint64_t rax)
+{
+    if (vcpu->is_dom0() &&
+        rax >= hypercall_enum_domain_op__rax &&
+        rax <= hypercall_enum_domain_op__set_ldtr_access_rights) {
+        return true;
+    }
+
+    switch (rax) {
+        case hypercall_enum_domain_op__create_domain:
+        case hypercall_enum_domain_op__destroy_domain:
+        case hypercall_enum_domain_op__set_uart:
+        case hypercall_enum_domain_op__set_pt_uart:
+        case hypercall_enum_domain_op__dump_uart:
+        case hypercall_enum_domain_op__set_uart_ring:
+        case hypercall_enum_domain_op__write_uart:
+        case hypercall_enum_domain_op__dump_uart_buffer:
+        case hypercall_enum_domain_op__set_cpu_quota:
+        case hypercall_enum_domain_op__register_buffer:
+        case hypercall_enum_domain_op__unregister_buffer:
+        case hypercall_enum_domain_op__share_page_r:
+        case hypercall_enum_domain_op__share_page_rw:
+        case hypercall_enum_domain_op__share_page_rwe:
+        case hypercall_enum_domain_op__donate_page_r:
+        case hypercall_enum_domain_op__donate_page_rw:
+        case hypercall_enum_domain_op__donate_page_rwe:
+        case hypercall_enum_vcpu_op__create_vcpu:
+        case hypercall_enum_vcpu_op__kill_vcpu:
+        case hypercall_enum_vcpu_op__destroy_vcpu:
+        case hypercall_enum_vcpu_op__get_runstate:
+        case hypercall_enum_vclock_op__set_host_wallclock:
+            return vcpu->is_dom0();
+
+        case hypercall_enum_virq_op__set_hypervisor_callback_vector:
+        case hypercall_enum_virq_op__get_next_virq:
+        case hypercall_enum_virq_op__set_virq_page:
+        case hypercall_enum_vclock_op__set_next_event:
+        case hypercall_enum_vclock_op__set_guest_wallclock_rtc:
+        case hypercall_enum_vclock_op__set_guest_wallclock_tsc:
+        case hypercall_enum_vclock_op__set_vclock_page:
+        case hypercall_enum_vclock_op__sync_next_event:
+        case hypercall_enum_vclock_op__set_steal_time_page:
+            return vcpu->is_domU();
+
+        case hypercall_enum_uart_op__write:
+        case hypercall_enum_vclock_op__get_tsc_freq_khz:
+            return true;
+
+        default:
+            return false;
+    };
+}
+
+void
+vmcall_handler::multicall(
+    const gsl::span<struct hypercall_multicall_entry> &entries)
+{
+    // Note:
+    //
+    // Each entry is executed by the same handler that would have executed
+    // it as a standalone hypercall, so the entry's registers are loaded into
+    // the vCPU, and the result is read back from rax. The caller's registers
+    // are restored once the batch is done, even if an entry throws.
+    //
+
+    auto rbx = m_vcpu->rbx();
+    auto rcx = m_vcpu->rcx();
+    auto rdx = m_vcpu->rdx();
+
+    auto ___ = gsl::finally([&] {
+        m_vcpu->set_rbx(rbx);
+        m_vcpu->set_rcx(rcx);
+        m_vcpu->set_rdx(rdx);
+    });
+
+    for (auto &entry : entries) {
+
+        // Note:
+        //
+        // The entries live in guest memory, so each entry is read once
+        // before it is checked, otherwise another vCPU could change the
+        // opcode after it was checked.
+        //
+
+        auto rax = __atomic_load_n(&entry.rax, __ATOMIC_RELAXED);
+        const auto &handler = m_handlers[bfopcode(rax)];
+
+        if (!handler.enabled || !multicall_allowed(m_vcpu, rax)) {
+            entry.ret = FAILURE;
+            continue;
+        }
+
+        m_vcpu->set_rax(rax);
+        m_vcpu->set_rbx(entry.rbx);
+        m_vcpu->set_rcx(entry.rcx);
+        m_vcpu->set_rdx(entry.rdx);
+
+        try {
+            entry.ret = this->dispatch(handler) ? m_vcpu->rax() : FAILURE;
+        }
+        catchall({
+            entry.ret = FAILURE;
+        })
+    }
+}
+
+void
+vmcall_handler::multicall_op__multicall(vcpu *vcpu)
+{
+    auto num = vcpu->rcx();
+
+    if (num == 0 || num > HYPERCALL_MULTICALL_MAX_ENTRIES) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        auto entries = vcpu->map_gva_4k<struct hypercall_multicall_entry>(
+            vcpu->rbx(), num * sizeof(struct hypercall_multicall_entry)
+        );
+
+        this->multicall(
+            gsl::span<struct hypercall_multicall_entry>(
+                entries.get(), static_cast<std::ptrdiff_t>(num))
+        );
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vmcall_handler::multicall_op__set_multicall_page(vcpu *vcpu)
+{
+    static_assert(
+        HYPERCALL_MULTICALL_MAX_ENTRIES *
+        sizeof(struct hypercall_multicall_entry) <= BAREFLANK_PAGE_SIZE);
+
+    if (vcpu->rbx() == 0) {
+        m_multicall_page.reset();
+        vcpu->set_rax(SUCCESS);
+
+        return;
+    }
+
+    // Note:
+    //
+    // Only the page that holds the gpa is mapped, so the gpa has to be page
+    // aligned, otherwise the entries would run past the end of the map.
+    //
+
+    if ((vcpu->rbx() & (BAREFLANK_PAGE_SIZE - 1)) != 0) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    try {
+        m_multicall_page =
+            vcpu->map_gpa_4k<struct hypercall_multicall_entry>(vcpu->rbx());
+
+        vcpu->set_rax(SUCCESS);
+    }
+    catchall({
+        vcpu->set_rax(FAILURE);
+    })
+}
+
+void
+vmcall_handler::multicall_op__multicall_page(vcpu *vcpu)
+{
+    auto num = vcpu->rbx();
+
+    if (!m_multicall_page || num == 0 || num > HYPERCALL_MULTICALL_MAX_ENTRIES) {
+        vcpu->set_rax(FAILURE);
+        return;
+    }
+
+    this->multicall(
+        gsl::span<struct hypercall_multicall_entry>(
+            m_multicall_page.get(), static_cast<std::ptrdiff_t>(num))
+    );
+
+    vcpu->set_rax(SUCCESS);
+}
+
+bool
+vmcall_handler::handle_multicall(vcpu *vcpu)
+{
+    // Note:
+    //
+    // This is registered as a fast handler as it never loads another VMCS
+    // itself. Entries that are serviced by a (non-fast) handler that might
+    // load another VMCS reload this vCPU's VMCS as each entry completes
+    // (see dispatch).
+    //
+
+    switch (vcpu->rax()) {
+        case hypercall_enum_multicall_op__multicall:
+            this->multicall_op__multicall(vcpu);
+            return true;
+
+        case hypercall_enum_multicall_op__set_multicall_page:
+            this->multicall_op__set_multicall_page(vcpu);
+            return true;
+
+        case hypercall_enum_multicall_op__multicall_page:
+            this->multicall_op__multicall_page(vcpu);
+            return true;
+
+        default:
+            return false;
+    };
+}
+
 }